@@ -0,0 +1,212 @@
+#include "arena.h"
+#include <stdint.h>
+#include <string.h>
+
+struct FmlArenaChunk_s
+{
+	FmlArenaChunk * Next;
+	size_t Size, Used;
+
+	max_align_t Data[];
+};
+
+#define ALIGNMENT (_Alignof(max_align_t))
+#define ALIGN_UP(x) (((x) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+static FmlArenaChunk * CreateChunk(size_t size)
+{
+	FmlArenaChunk * ch = malloc(sizeof(FmlArenaChunk) + size);
+
+	if (ch == NULL)
+		return NULL;
+
+	ch->Next = NULL;
+	ch->Size = size;
+	ch->Used = 0;
+
+	return ch;
+}
+
+FmlArena * FmlCreateArena(size_t chunkSize)
+{
+	FmlArena * a = calloc(1, sizeof(FmlArena));
+
+	if (a == NULL)
+		return NULL;
+
+	a->ChunkSize = ALIGN_UP(chunkSize == 0 ? FML_ARENA_DEFAULT_CHUNK_SIZE : chunkSize);
+
+	return a;
+}
+
+void FmlFreeArena(FmlArena * a)
+{
+	for (FmlArenaChunk * ch = a->Chunks; ch != NULL; /* nothing */)
+	{
+		FmlArenaChunk * chNext = ch->Next;
+		free(ch);
+		ch = chNext;
+	}
+
+	free(a);
+}
+
+void FmlResetArena(FmlArena * a)
+{
+	FmlArenaChunk * ch = a->Chunks, * last = NULL;
+
+	while (ch != NULL)
+	{
+		FmlArenaChunk * chNext = ch->Next;
+
+		//	The last chunk in the list is the oldest, and it's the one kept,
+		//	unless it was an oversized one.
+		if (chNext == NULL && ch->Size == a->ChunkSize)
+			last = ch;
+		else
+			free(ch);
+
+		ch = chNext;
+	}
+
+	if (last != NULL)
+		last->Used = 0;
+
+	a->Chunks = last;
+}
+
+void * FmlArenaAlloc(FmlArena * a, size_t size)
+{
+	FmlArenaChunk * ch = a->Chunks;
+	size = ALIGN_UP(size);
+
+	if (ch == NULL || ch->Size - ch->Used < size)
+	{
+		if (size > a->ChunkSize / 4)
+		{
+			//	Large allocations get a chunk of their own, which goes behind
+			//	the current one so the latter's free space isn't wasted.
+			FmlArenaChunk * big = CreateChunk(size);
+
+			if (big == NULL)
+				return NULL;
+
+			big->Used = size;
+
+			if (ch == NULL)
+				a->Chunks = big;
+			else
+			{
+				big->Next = ch->Next;
+				ch->Next = big;
+			}
+
+			return big->Data;
+		}
+
+		if ((ch = CreateChunk(a->ChunkSize)) == NULL)
+			return NULL;
+
+		ch->Next = a->Chunks;
+		a->Chunks = ch;
+	}
+
+	void * res = (uint8_t *)(ch->Data) + ch->Used;
+	ch->Used += size;
+
+	return res;
+}
+
+void * FmlArenaGrow(FmlArena * a, void * ptr, size_t oldSize, size_t newSize)
+{
+	if (ptr == NULL)
+		return FmlArenaAlloc(a, newSize);
+
+	oldSize = ALIGN_UP(oldSize);
+	newSize = ALIGN_UP(newSize);
+
+	if (newSize <= oldSize)
+		return ptr;
+
+	//	Look for a dedicated chunk holding just this block. The search is
+	//	linear in the number of chunks, which can be large, but callers grow
+	//	blocks geometrically, so each one is only searched for a logarithmic
+	//	number of times.
+	for (FmlArenaChunk * * chp = &(a->Chunks); *chp != NULL; chp = &((*chp)->Next))
+	{
+		FmlArenaChunk * ch = *chp;
+
+		if ((void *)(ch->Data) != ptr)
+			continue;
+
+		if (ch->Used != oldSize || newSize <= a->ChunkSize / 4)
+			break;
+
+		FmlArenaChunk * nch = realloc(ch, sizeof(FmlArenaChunk) + newSize);
+
+		if (nch == NULL)
+			return NULL;
+
+		nch->Size = nch->Used = newSize;
+		*chp = nch;
+
+		return nch->Data;
+	}
+
+	void * res = FmlArenaAlloc(a, newSize);
+
+	if (res != NULL)
+		memcpy(res, ptr, oldSize);
+
+	return res;
+}
+
+void FmlArenaRelease(FmlArena * a, void * ptr, size_t size)
+{
+	if (ptr == NULL)
+		return;
+
+	size = ALIGN_UP(size);
+
+	for (FmlArenaChunk * * chp = &(a->Chunks); *chp != NULL; chp = &((*chp)->Next))
+	{
+		FmlArenaChunk * ch = *chp;
+
+		if ((void *)(ch->Data) != ptr)
+			continue;
+
+		//	Only a chunk holding nothing else can go.
+		if (ch->Used == size)
+		{
+			*chp = ch->Next;
+			free(ch);
+		}
+
+		return;
+	}
+}
+
+void FmlMergeArena(FmlArena * a, FmlArena * other)
+{
+	FmlArenaChunk * first = other->Chunks;
+
+	if (first != NULL)
+	{
+		FmlArenaChunk * last = first;
+
+		while (last->Next != NULL)
+			last = last->Next;
+
+		//	The chunks go behind the current one, which keeps serving
+		//	allocations.
+		if (a->Chunks == NULL)
+			a->Chunks = first;
+		else
+		{
+			last->Next = a->Chunks->Next;
+			a->Chunks->Next = first;
+		}
+	}
+
+	free(other);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stddef.h>
+
+typedef struct FmlArenaChunk_s FmlArenaChunk;
+
+//	A bump allocator made of a list of chunks.
+//	Individual allocations are never freed; the whole arena is released
+//	at once, which makes teardown proportional to the number of chunks.
+typedef struct FmlArena_s
+{
+	FmlArenaChunk * Chunks;	//	Most recent chunk first.
+	size_t ChunkSize;
+} FmlArena;
+
+#define FML_ARENA_DEFAULT_CHUNK_SIZE ((size_t)64 * 1024)
+
+//	A chunk size of 0 picks the default. Returns null if there's no memory.
+FmlArena * FmlCreateArena(size_t chunkSize);
+void FmlFreeArena(FmlArena * a);
+
+//	Releases every allocation but keeps the first chunk around for reuse.
+void FmlResetArena(FmlArena * a);
+
+void * FmlArenaAlloc(FmlArena * a, size_t size);
+
+//	Returns a block of `newSize` bytes holding the first `oldSize` bytes of `ptr`.
+//	Blocks large enough to sit in a chunk of their own are resized in place
+//	(well, by `realloc`); others are copied and the old space is abandoned.
+void * FmlArenaGrow(FmlArena * a, void * ptr, size_t oldSize, size_t newSize);
+
+//	Frees a block of `size` bytes if it sits in a chunk of its own; otherwise
+//	it is left alone, like any other allocation.
+void FmlArenaRelease(FmlArena * a, void * ptr, size_t size);
+
+//	Moves every allocation of `other` over to `a`, and frees `other`.
+void FmlMergeArena(FmlArena * a, FmlArena * other);
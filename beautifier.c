@@ -33,15 +33,6 @@ static int _SinkEx(SinkContext * sct, char const * str, size_t len)
 }
 #define SinkEx(a, b, c) do { int _res = _SinkEx(a, b, c); if (_res != 0) return _res; } while (false)
 
-static int _Sink(SinkContext * sct, char const * str)
-{
-	// printf("_Sink %s\n", str);
-	size_t const len = strlen(str);
-
-	return _SinkEx(sct, str, len);
-}
-#define Sink(a, b) do { int _res = _Sink(a, b); if (_res != 0) return _res; } while (false)
-
 static int _SinkIndent(SinkContext * sct)
 {
 	// printf("_SinkIndent %d\n", sct->IndentLevel);
@@ -221,24 +212,24 @@ static int SinkNode(SinkContext * sct, Node const * n)
 	int res;
 
 	SinkIndent(sct);
-	Sink(sct, n->Name);
+	SinkEx(sct, n->Name, n->NameLength);
 
 	for (Class const * cl = n->Classes; cl != NULL; cl = cl->Next)
 	{
 		SinkEx(sct, ".", 1);
-		Sink(sct, cl->Name);
+		SinkEx(sct, cl->Name, cl->NameLength);
 	}
 
 	if (n->Id)
 	{
 		SinkEx(sct, "#", 1);
-		Sink(sct, n->Id);
+		SinkEx(sct, n->Id, n->IdLength);
 	}
 
 	for (Attribute * a = n->Attributes; a != NULL; a = a->Next)
 	{
 		SinkSpace(sct);
-		Sink(sct, a->Key);
+		SinkEx(sct, a->Key, a->KeyLength);
 
 		if (a->ValueType == AVT_NONE)
 			continue;
@@ -276,6 +267,7 @@ static int SinkNode(SinkContext * sct, Node const * n)
 	switch (n->BodyType)
 	{
 	case NBT_NONE:
+	case NBT_EXPANDED:
 		SinkEx(sct, ";", 1);
 		break;
 
@@ -287,6 +279,9 @@ static int SinkNode(SinkContext * sct, Node const * n)
 			return res;
 		break;
 
+	case NBT_LAZY:
+		return -10002;	//	Not loaded; see FmlLoadAll.
+
 	case NBT_CHILDREN:
 		do{}while(false);	//	Screw you, C.
 
@@ -0,0 +1,354 @@
+#include "lexer.h"
+#include "parser.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+//	Generates large documents and reports how fast they are lexed and parsed.
+//	The documents are the same on every run, so numbers can be compared
+//	between builds.
+//
+//		bench [megabytes [runs [workload...]]]
+//
+//	The workloads are a mixed document, and one for each class of token.
+//
+//	Each stage is timed a few times and the best run is reported, which
+//	keeps the noise of a busy machine out of the numbers.
+
+typedef struct Buffer_s
+{
+	char * Data;
+	size_t Size, Capacity;
+} Buffer;
+
+static void Put(Buffer * b, char const * str, size_t len)
+{
+	if (b->Size + len > b->Capacity)
+	{
+		size_t cap = b->Capacity < 4096 ? 4096 : b->Capacity;
+
+		while (cap < b->Size + len)
+			cap *= 2;
+
+		char * data = realloc(b->Data, cap);
+
+		if (data == NULL)
+		{
+			fputs("Out of memory.\n", stderr);
+			exit(1);
+		}
+
+		b->Data = data;
+		b->Capacity = cap;
+	}
+
+	memcpy(b->Data + b->Size, str, len);
+	b->Size += len;
+}
+
+static void PutStr(Buffer * b, char const * str)
+{
+	Put(b, str, strlen(str));
+}
+
+static void PutF(Buffer * b, char const * fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#include <stdarg.h>
+
+static void PutF(Buffer * b, char const * fmt, ...)
+{
+	char tmp[256];
+	va_list args;
+
+	va_start(args, fmt);
+	int const len = vsnprintf(tmp, sizeof(tmp), fmt, args);
+	va_end(args);
+
+	Put(b, tmp, len < (int)sizeof(tmp) ? (size_t)len : sizeof(tmp) - 1);
+}
+
+//	xorshift64*; the generated documents only need to be varied and repeatable.
+static uint64_t Random(uint64_t * state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * 0x2545F4914F6CDD1Dull;
+}
+
+static char const * const Words[] = {
+	"window", "head", "body", "button", "label", "panel", "text", "image",
+	"title", "width", "height", "color", "margin", "padding", "visible", "on-click",
+};
+
+#define WORD(r) (Words[(r) % (sizeof(Words) / sizeof(Words[0]))])
+
+//	A node with a bit of everything, and children down to a few levels.
+static void PutMixedNode(Buffer * b, uint64_t * rng, int depth)
+{
+	uint64_t const r = Random(rng);
+
+	PutF(b, "%*s%s", depth, "", WORD(r));
+
+	for (unsigned i = 0; i < (r >> 8) % 3; ++i)
+		PutF(b, ".%s", WORD(r >> (12 + i * 4)));
+
+	if ((r >> 24) % 4 == 0)
+		PutF(b, "#n%u", (unsigned)(r >> 32) % 100000);
+
+	for (unsigned i = 0; i < (r >> 28) % 4; ++i)
+	{
+		uint64_t const v = Random(rng);
+
+		switch (v % 5)
+		{
+		//	Numbers have to be followed by whitespace.
+		case 0: PutF(b, " %s=%u ", WORD(v >> 8), (unsigned)(v >> 16) % 10000); break;
+		case 1: PutF(b, " %s=%u.%02u ", WORD(v >> 8), (unsigned)(v >> 16) % 1000, (unsigned)(v >> 32) % 100); break;
+		case 2: PutF(b, " %s=\"%s %s\"", WORD(v >> 8), WORD(v >> 16), WORD(v >> 24)); break;
+		case 3: PutF(b, " %s=$%s", WORD(v >> 8), WORD(v >> 16)); break;
+		default: PutF(b, " %s", WORD(v >> 8)); break;
+		}
+	}
+
+	switch ((r >> 40) % 6)
+	{
+	case 0:
+	case 1:
+		if (depth < 8)
+		{
+			PutStr(b, " {\n");
+
+			for (unsigned i = 0; i < 1 + (r >> 44) % 4; ++i)
+				PutMixedNode(b, rng, depth + 1);
+
+			PutF(b, "%*s}\n", depth, "");
+			break;
+		}
+		//	Fall through.
+
+	case 2:
+		PutF(b, " [[\n%*s%s %s\n%*s]]\n", depth + 1, "", WORD(r >> 48), WORD(r >> 52), depth, "");
+		break;
+
+	default:
+		PutStr(b, ";\n");
+		break;
+	}
+}
+
+static void GenerateMixed(Buffer * b, size_t size, uint64_t * rng)
+{
+	while (b->Size < size)
+	{
+		PutMixedNode(b, rng, 0);
+
+		if (Random(rng) % 8 == 0)
+			PutStr(b, "/* A comment between nodes. */\n");
+	}
+}
+
+//	The rest each stick to one class of token as much as they can, to show
+//	how the lexer does on it alone.
+
+static void GenerateIdentifiers(Buffer * b, size_t size, uint64_t * rng)
+{
+	while (b->Size < size)
+	{
+		uint64_t const r = Random(rng);
+
+		PutF(b, "%s %s-%s %s_%u %s %s;\n", WORD(r), WORD(r >> 4), WORD(r >> 8),
+			WORD(r >> 12), (unsigned)(r >> 32) % 1000, WORD(r >> 16), WORD(r >> 20));
+	}
+}
+
+static void GenerateNumbers(Buffer * b, size_t size, uint64_t * rng)
+{
+	while (b->Size < size)
+	{
+		uint64_t const r = Random(rng);
+
+		PutF(b, "n a=%u b=-%u c=%u.%03u d=%ue%u e=%llu ;\n",
+			(unsigned)r % 100, (unsigned)(r >> 8) % 100000, (unsigned)(r >> 16) % 1000,
+			(unsigned)(r >> 24) % 1000, (unsigned)(r >> 32) % 10, (unsigned)(r >> 40) % 30,
+			(unsigned long long)(r >> 4));
+	}
+}
+
+static void GenerateStrings(Buffer * b, size_t size, uint64_t * rng)
+{
+	while (b->Size < size)
+	{
+		uint64_t const r = Random(rng);
+
+		PutF(b, "n a=\"%s %s %s, %s %s %s.\" b=\"%s \\\"%s\\\" \\n %s\" c=\"\" ;\n",
+			WORD(r), WORD(r >> 4), WORD(r >> 8), WORD(r >> 12), WORD(r >> 16), WORD(r >> 20),
+			WORD(r >> 24), WORD(r >> 28), WORD(r >> 32));
+	}
+}
+
+//	Not a valid document, just a pile of single-character tokens.
+static void GeneratePunctuation(Buffer * b, size_t size, uint64_t * rng)
+{
+	static char const marks[] = "{};.#=$";
+
+	while (b->Size < size)
+	{
+		uint64_t r = Random(rng);
+		char line[33];
+
+		for (int i = 0; i < 31; ++i, r >>= 2)
+			line[i] = (i & 1) ? ' ' : marks[(r ^ (unsigned)i) % (sizeof(marks) - 1)];
+
+		line[31] = '\n';
+		line[32] = '\0';
+		PutStr(b, line);
+	}
+}
+
+static void GenerateDocuments(Buffer * b, size_t size, uint64_t * rng)
+{
+	while (b->Size < size)
+	{
+		uint64_t const r = Random(rng);
+
+		PutF(b, "n [=[\n%s [%s] %s]] %s\n%s %s %s %s\n]=]\n", WORD(r), WORD(r >> 4),
+			WORD(r >> 8), WORD(r >> 12), WORD(r >> 16), WORD(r >> 20), WORD(r >> 24), WORD(r >> 28));
+	}
+}
+
+static void GenerateComments(Buffer * b, size_t size, uint64_t * rng)
+{
+	while (b->Size < size)
+	{
+		uint64_t const r = Random(rng);
+
+		PutF(b, "/* %s %s %s */\n\t\t// %s %s\n    n;\n", WORD(r), WORD(r >> 4), WORD(r >> 8),
+			WORD(r >> 12), WORD(r >> 16));
+	}
+}
+
+typedef struct Workload_s
+{
+	char const * Name;
+	void (*Generate)(Buffer * b, size_t size, uint64_t * rng);
+	bool Parse;	//	Whether it's a valid document worth parsing.
+} Workload;
+
+static Workload const Workloads[] = {
+	{ "mixed", &GenerateMixed, true },
+	{ "identifiers", &GenerateIdentifiers, true },
+	{ "numbers", &GenerateNumbers, true },
+	{ "strings", &GenerateStrings, true },
+	{ "punctuation", &GeneratePunctuation, false },
+	{ "documents", &GenerateDocuments, true },
+	{ "comments", &GenerateComments, true },
+};
+
+static double Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)(ts.tv_sec) + (double)(ts.tv_nsec) / 1e9;
+}
+
+static size_t errors;
+
+static bool CountLexerError(LexerState * l, size_t loc, char const * err)
+{
+	(void)l;
+	(void)loc;
+	(void)err;
+
+	++errors;
+	return false;
+}
+
+static bool CountParserError(ParserState * p, size_t loc, size_t cnt, char const * err)
+{
+	(void)p;
+	(void)loc;
+	(void)cnt;
+	(void)err;
+
+	++errors;
+	return false;
+}
+
+static void RunWorkload(Workload const * w, size_t size, int runs)
+{
+	Buffer b = { 0 };
+	uint64_t rng = 0x9E3779B97F4A7C15ull;
+
+	w->Generate(&b, size, &rng);
+	errors = 0;
+
+	LexerOptions const lopts = { .Flags = LF_READ_ONLY };
+	double bestLex = 0.0, bestParse = 0.0;
+	size_t tokens = 0, nodes = 0;
+
+	for (int i = 0; i < runs; ++i)
+	{
+		double const t0 = Now();
+		LexerState * l = LexEx(b.Data, b.Size, &CountLexerError, &lopts);
+		double const t1 = Now();
+
+		tokens = l->Tokens.Count;
+
+		if (i == 0 || t1 - t0 < bestLex)
+			bestLex = t1 - t0;
+
+		if (w->Parse)
+		{
+			double const t2 = Now();
+			ParserState * p = ParseEx(l, &CountParserError, NULL);
+			double const t3 = Now();
+
+			if (i == 0 || t3 - t2 < bestParse)
+				bestParse = t3 - t2;
+
+			nodes = 0;
+
+			for (Node const * n = p->Nodes; n != NULL; n = FmlNextNode(n))
+				++nodes;
+
+			FreeParserState(p);
+		}
+
+		FreeLexerState(l);
+	}
+
+	printf("%-12s %8.1f MB %10zu tokens  lex %7.3f s %7.2f Mtok/s %7.1f MB/s",
+		w->Name, (double)(b.Size) / 1e6, tokens,
+		bestLex, (double)tokens / bestLex / 1e6, (double)(b.Size) / bestLex / 1e6);
+
+	if (w->Parse)
+		printf("  parse %7.3f s %7.2f Mtok/s (%zu nodes)", bestParse, (double)tokens / bestParse / 1e6, nodes);
+
+	if (errors > 0)
+		printf("  %zu errors", errors / (size_t)runs);
+
+	putchar('\n');
+	free(b.Data);
+}
+
+int main(int argc, char * * argv)
+{
+	size_t const megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+	int const runs = argc > 2 ? atoi(argv[2]) : 5;
+
+	for (size_t i = 0; i < sizeof(Workloads) / sizeof(Workloads[0]); ++i)
+	{
+		bool picked = argc <= 3;
+
+		for (int j = 3; j < argc; ++j)
+			picked = picked || strcmp(argv[j], Workloads[i].Name) == 0;
+
+		if (picked)
+			RunWorkload(Workloads + i, megabytes << 20, runs > 0 ? runs : 1);
+	}
+
+	return 0;
+}
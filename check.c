@@ -0,0 +1,115 @@
+#include "lexer.h"
+#include "parser.h"
+#include "selector.h"
+#include <stdio.h>
+#include <string.h>
+
+//	Checks for bugs which have been fixed, so they stay fixed. Prints what
+//	fails, and exits with the number of failures.
+//
+//	Run it through `make check`, which fills fresh memory with garbage, as
+//	some of these only show when memory isn't zeroed.
+
+static int failures;
+
+static void Fail(char const * what, char const * detail)
+{
+	printf("FAIL: %s: %s\n", what, detail);
+	++failures;
+}
+
+static bool IgnoreParserError(ParserState * p, size_t loc, size_t cnt, char const * err)
+{
+	(void)p;
+	(void)loc;
+	(void)cnt;
+	(void)err;
+
+	return false;
+}
+
+//	Every part of a selector which isn't spelled out has to be empty.
+static void CheckSelectorParts(char const * str)
+{
+	FmlSelectorError err = { 0 };
+	FmlSelector * sel = FmlCompileSelector(str, strlen(str), NULL, &err);
+
+	if (sel == NULL)
+	{
+		Fail(str, err.Message);
+		return;
+	}
+
+	for (size_t i = 0; i < sel->AlternativeCount; ++i)
+		for (size_t j = 0; j < sel->Alternatives[i].StepCount; ++j)
+		{
+			FmlSelectorStep const * const step = sel->Alternatives[i].Steps + j;
+
+			if (step->Id != NULL || step->ClassCount != 0 || step->AttributeCount != 0)
+				Fail(str, "step has parts it wasn't given");
+		}
+
+	FmlFreeSelector(sel);
+}
+
+static void CheckSelect(ParserState * p, char const * str, size_t expected)
+{
+	FmlSelectorError err = { 0 };
+	FmlSelector * sel = FmlCompileSelector(str, strlen(str), NULL, &err);
+	FmlNodeList res = { 0 };
+
+	if (sel == NULL)
+	{
+		Fail(str, err.Message);
+		return;
+	}
+
+	if (!FmlSelect(sel, p, &res))
+		Fail(str, "out of memory");
+	else if (res.Count != expected)
+		Fail(str, "wrong number of nodes selected");
+
+	FmlClearNodeList(&res);
+	FmlFreeSelector(sel);
+}
+
+static void CheckSelectors(void)
+{
+	static char const doc[] =
+		"a { b { c { d.w.x.y.z.v#i k1=1 k2=2 k3=3 k4=\"v\" k5=5.5 ; } } }\n"
+		"e; f; g; h;\n"
+		"s t=\"a\\nb\" u=\"q\\\"\\\\\" ;\n";
+
+	CheckSelectorParts("a b c d e");
+	CheckSelectorParts("a > b > c > d > e");
+	CheckSelectorParts("a, b, c, d, e");
+
+	LexerState * l = Lex(doc, sizeof(doc) - 1, &ReportLexerErrorDefault);
+	ParserState * p = ParseEx(l, &IgnoreParserError, NULL);
+
+	CheckSelect(p, "a b c d", 1);
+	CheckSelect(p, "a > b > c > d", 1);
+	CheckSelect(p, "d.w.x.y.z.v", 1);
+	CheckSelect(p, "d.w.x.y.z.u", 0);
+	CheckSelect(p, "[k1=1][k2=2][k3=3][k4=v][k5=5.5]", 1);
+	CheckSelect(p, "[k1][k2][k3][k4][k6]", 0);
+	CheckSelect(p, "e, f, g, h, d#i", 5);
+
+	//	Escape sequences mean what they mean in documents.
+	CheckSelect(p, "[t=\"a\\nb\"]", 1);
+	CheckSelect(p, "[t=\"anb\"]", 0);
+	CheckSelect(p, "[u=\"q\\\"\\\\\"]", 1);
+
+	FreeParserState(p);
+	FreeLexerState(l);
+}
+
+int main(void)
+{
+	CheckSelectors();
+
+	if (failures == 0)
+		puts("All checks passed.");
+
+	return failures;
+}
@@ -0,0 +1,645 @@
+#include "flat.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct StringSlot_s
+{
+	uint32_t Hash, Length;
+	uint32_t Offset;	//	Plus one; 0 is an empty slot.
+} StringSlot;
+
+typedef struct FlatBuilder_s
+{
+	FmlFlatTree * tree;
+
+	Node const * * sources;	//	The tree node behind every flat node.
+	size_t nodeCap, sourceCap, classCap, attributeCap, stringsCap;
+
+	StringSlot * strings;	//	Every distinct string in the pool, by hash.
+	size_t stringSlotCount, stringCount;
+} FlatBuilder;
+
+//	Makes room for `count` more elements in an array, doubling it as needed.
+//	Everything has to be addressable with 32 bits.
+static bool Reserve(void * arr, size_t * cap, size_t used, size_t count, size_t size)
+{
+	if (used + count <= *cap)
+		return true;
+
+	size_t newCap = *cap < 64 ? 64 : *cap * 2;
+
+	while (newCap < used + count)
+		newCap *= 2;
+
+	if (newCap > UINT32_MAX)
+	{
+		if (used + count > UINT32_MAX)
+			return false;
+
+		newCap = UINT32_MAX;
+	}
+
+	void * res = realloc(*(void * *)arr, newCap * size);
+
+	if (res == NULL)
+		return false;
+
+	*(void * *)arr = res;
+	*cap = newCap;
+
+	return true;
+}
+
+//	Keeps the string table at most half full.
+static bool GrowStringSlots(FlatBuilder * b)
+{
+	size_t const newCount = b->stringSlotCount < 256 ? 256 : b->stringSlotCount * 2;
+	StringSlot * slots = calloc(newCount, sizeof(StringSlot));
+
+	if (slots == NULL)
+		return false;
+
+	for (size_t i = 0; i < b->stringSlotCount; ++i)
+	{
+		StringSlot const slot = b->strings[i];
+
+		if (slot.Offset == 0)
+			continue;
+
+		size_t j = slot.Hash & (newCount - 1);
+
+		while (slots[j].Offset != 0)
+			j = (j + 1) & (newCount - 1);
+
+		slots[j] = slot;
+	}
+
+	free(b->strings);
+	b->strings = slots;
+	b->stringSlotCount = newCount;
+
+	return true;
+}
+
+//	Names, keys and values repeat a lot, so every distinct string is only
+//	stored once.
+static bool AddString(FlatBuilder * b, char const * str, size_t len, FmlFlatString * res)
+{
+	FmlFlatTree * const ft = b->tree;
+	uint32_t const hash = FmlHashName(str, len);
+
+	if ((b->stringCount + 1) * 2 > b->stringSlotCount && !GrowStringSlots(b))
+		return false;
+
+	size_t const mask = b->stringSlotCount - 1;
+	StringSlot * slot = b->strings + (hash & mask);
+
+	for (/* nothing */; slot->Offset != 0; slot = b->strings + ((slot - b->strings + 1) & mask))
+		if (slot->Hash == hash && slot->Length == len
+			&& memcmp(ft->Strings + slot->Offset - 1, str, len) == 0)
+		{
+			*res = (FmlFlatString){ slot->Offset - 1, (uint32_t)len };
+
+			return true;
+		}
+
+	if (!Reserve(&(ft->Strings), &(b->stringsCap), ft->StringsSize, len + 1, 1))
+		return false;
+
+	//	Read-only lexers leave values unterminated, hence the copy.
+	if (len > 0)
+		memcpy(ft->Strings + ft->StringsSize, str, len);
+
+	ft->Strings[ft->StringsSize + len] = '\0';
+
+	*res = (FmlFlatString){ ft->StringsSize, (uint32_t)len };
+	*slot = (StringSlot){ hash, (uint32_t)len, ft->StringsSize + 1 };
+	++b->stringCount;
+	ft->StringsSize += (uint32_t)len + 1;
+
+	return true;
+}
+
+//	Queues up a list of siblings, which end up next to each other.
+static bool AddNodes(FlatBuilder * b, Node const * n, uint32_t * first, uint32_t * count)
+{
+	FmlFlatTree * const ft = b->tree;
+
+	*first = ft->NodeCount;
+
+	for (/* nothing */; n != NULL; n = n->Next)
+	{
+		if (!Reserve(&(ft->Nodes), &(b->nodeCap), ft->NodeCount, 1, sizeof(FmlFlatNode))
+			|| !Reserve(&(b->sources), &(b->sourceCap), ft->NodeCount, 1, sizeof(Node const *)))
+			return false;
+
+		b->sources[ft->NodeCount++] = n;
+	}
+
+	*count = ft->NodeCount - *first;
+
+	return true;
+}
+
+static bool FlattenNode(FlatBuilder * b, uint32_t i)
+{
+	FmlFlatTree * const ft = b->tree;
+	Node const * const n = b->sources[i];
+	FmlFlatNode fn = {
+		.Start = (uint32_t)(n->Start),
+		.End = (uint32_t)(n->End),
+		.NameSymbol = n->NameSymbol,
+		.FirstClass = ft->ClassCount,
+		.FirstAttribute = ft->AttributeCount,
+		.BodyType = (uint8_t)(n->BodyType),
+	};
+
+	if (!AddString(b, n->Name, n->NameLength, &(fn.Name)))
+		return false;
+
+	if (n->Id != NULL && !AddString(b, n->Id, n->IdLength, &(fn.Id)))
+		return false;
+
+	for (Class const * cl = n->Classes; cl != NULL; cl = cl->Next)
+	{
+		if (!Reserve(&(ft->Classes), &(b->classCap), ft->ClassCount, 1, sizeof(FmlFlatClass)))
+			return false;
+
+		FmlFlatClass * const fc = ft->Classes + ft->ClassCount++;
+		fc->Start = (uint32_t)(cl->Start);
+		fc->End = (uint32_t)(cl->End);
+		fc->NameSymbol = cl->NameSymbol;
+
+		if (!AddString(b, cl->Name, cl->NameLength, &(fc->Name)))
+			return false;
+	}
+
+	fn.ClassCount = ft->ClassCount - fn.FirstClass;
+
+	for (Attribute const * at = n->Attributes; at != NULL; at = at->Next)
+	{
+		if (!Reserve(&(ft->Attributes), &(b->attributeCap), ft->AttributeCount, 1, sizeof(FmlFlatAttribute)))
+			return false;
+
+		FmlFlatAttribute * const fa = ft->Attributes + ft->AttributeCount++;
+		*fa = (FmlFlatAttribute){
+			.Start = (uint32_t)(at->Start),
+			.End = (uint32_t)(at->End),
+			.KeySymbol = at->KeySymbol,
+			.ValueType = (uint8_t)(at->ValueType),
+		};
+
+		if (!AddString(b, at->Key, at->KeyLength, &(fa->Key)))
+			return false;
+
+		switch (at->ValueType)
+		{
+		case AVT_STRING:
+		case AVT_IDENTIFIER:
+		case AVT_REFERENCE:
+			//	A reference which failed to parse has no name.
+			if (at->sValue != NULL && !AddString(b, at->sValue, at->sLength, &(fa->sValue)))
+				return false;
+			break;
+
+		case AVT_INTEGER:
+			fa->lValue = at->lValue;
+			break;
+
+		case AVT_FLOAT:
+			fa->dValue = at->dValue;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	fn.AttributeCount = ft->AttributeCount - fn.FirstAttribute;
+
+	if (n->BodyType == NBT_CHILDREN)
+	{
+		if (!AddNodes(b, n->Children, &(fn.FirstChild), &(fn.ChildCount)))
+			return false;
+	}
+	else if (n->BodyType == NBT_DOCUMENT)
+	{
+		if (!AddString(b, n->Document, n->DocumentLength, &(fn.Document)))
+			return false;
+	}
+
+	ft->Nodes[i] = fn;
+
+	return true;
+}
+
+//	Trims an array down to its contents.
+static void * Shrink(void * arr, size_t count, size_t size)
+{
+	if (count == 0)
+	{
+		free(arr);
+		return NULL;
+	}
+
+	void * res = realloc(arr, count * size);
+
+	return res != NULL ? res : arr;
+}
+
+FmlFlatTree * FmlFlattenTree(ParserState const * p)
+{
+	FmlFlatTree * ft = calloc(1, sizeof(FmlFlatTree));
+
+	if (ft == NULL)
+		return NULL;
+
+	FlatBuilder b = { .tree = ft };
+
+	//	Nodes are laid out breadth-first: each one queues its children up at
+	//	the end, as a block, until the queue runs dry.
+	bool ok = AddNodes(&b, p->Nodes, &(uint32_t){ 0 }, &(ft->RootCount));
+
+	for (uint32_t i = 0; ok && i < ft->NodeCount; ++i)
+		ok = FlattenNode(&b, i);
+
+	free(b.sources);
+	free(b.strings);
+
+	if (!ok)
+	{
+		FmlFreeFlatTree(ft);
+		return NULL;
+	}
+
+	ft->Nodes = Shrink(ft->Nodes, ft->NodeCount, sizeof(FmlFlatNode));
+	ft->Classes = Shrink(ft->Classes, ft->ClassCount, sizeof(FmlFlatClass));
+	ft->Attributes = Shrink(ft->Attributes, ft->AttributeCount, sizeof(FmlFlatAttribute));
+	ft->Strings = Shrink(ft->Strings, ft->StringsSize, 1);
+
+	return ft;
+}
+
+FmlFlatTree * FmlParseFlat(LexerState const * l, ParserErrorSink ers, ParserOptions const * opts)
+{
+	ParserOptions o = opts != NULL ? *opts : (ParserOptions){ 0 };
+	o.Arena = FmlCreateArena(0);
+	o.LazyBodies = false;	//	Everything gets flattened anyway.
+
+	if (o.Arena == NULL)
+		return NULL;
+
+	ParserState * p = ParseEx(l, ers, &o);
+	FmlFlatTree * ft = FmlFlattenTree(p);
+
+	FreeParserState(p);
+	FmlFreeArena(o.Arena);
+
+	return ft;
+}
+
+void FmlFreeFlatTree(FmlFlatTree * ft)
+{
+	if (ft->mapping != NULL)
+	{
+		munmap(ft->mapping, ft->mappingSize);
+		free(ft);
+		return;
+	}
+
+	free(ft->Nodes);
+	free(ft->Classes);
+	free(ft->Attributes);
+	free(ft->Strings);
+	free(ft);
+}
+
+//	Like FmlHashName, but over the whole source, keeping all 64 bits, as a
+//	stale image is only caught by a mismatch.
+uint64_t FmlHashSource(char const * str, size_t len)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ull ^ len, w;
+
+	for (/* nothing */; len >= 8; str += 8, len -= 8)
+	{
+		memcpy(&w, str, 8);
+		h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+		h ^= h >> 32;
+	}
+
+	for (/* nothing */; len > 0; ++str, --len)
+		h = (h ^ (unsigned char)*str) * 0xFF51AFD7ED558CCDull;
+
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+
+	return h;
+}
+
+#define IMAGE_MAGIC 0x544C4D46u	//	"FMLT" on little-endian machines.
+#define IMAGE_VERSION 1
+
+//	Images start with this, followed by the nodes, classes, attributes and
+//	strings, each at a multiple of 8 bytes.
+typedef struct ImageHeader_s
+{
+	uint32_t Magic, Version;
+	uint32_t NodeSize, ClassSize, AttributeSize;	//	The layout must match.
+	uint32_t NodeCount, RootCount, ClassCount, AttributeCount, StringsSize;
+	uint64_t SourceHash;
+} ImageHeader;
+
+//	Fills in where each of the arrays goes, and returns the size of the image.
+static size_t LayOutImage(ImageHeader const * h, size_t offsets[4])
+{
+	size_t const sizes[4] = {
+		(size_t)(h->NodeCount) * sizeof(FmlFlatNode),
+		(size_t)(h->ClassCount) * sizeof(FmlFlatClass),
+		(size_t)(h->AttributeCount) * sizeof(FmlFlatAttribute),
+		h->StringsSize,
+	};
+
+	size_t pos = sizeof(ImageHeader);
+
+	for (int i = 0; i < 4; ++i)
+	{
+		offsets[i] = pos;
+		pos = (pos + sizes[i] + 7) & ~(size_t)7;
+	}
+
+	return pos;
+}
+
+static bool Pad(FILE * f, size_t from, size_t to)
+{
+	static char const zeros[8];
+
+	return fwrite(zeros, 1, to - from, f) == to - from;
+}
+
+static bool WriteImage(FILE * f, FmlFlatTree const * ft, uint64_t sourceHash)
+{
+	ImageHeader const h = {
+		IMAGE_MAGIC, IMAGE_VERSION,
+		sizeof(FmlFlatNode), sizeof(FmlFlatClass), sizeof(FmlFlatAttribute),
+		ft->NodeCount, ft->RootCount, ft->ClassCount, ft->AttributeCount, ft->StringsSize,
+		sourceHash,
+	};
+
+	size_t offsets[4];
+	size_t const size = LayOutImage(&h, offsets);
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+	//	Symbols are dropped on the way.
+	for (uint32_t i = 0; ok && i < ft->NodeCount; ++i)
+	{
+		FmlFlatNode fn = ft->Nodes[i];
+		fn.NameSymbol = 0;
+		ok = fwrite(&fn, sizeof(fn), 1, f) == 1;
+	}
+
+	ok = ok && Pad(f, offsets[0] + ft->NodeCount * sizeof(FmlFlatNode), offsets[1]);
+
+	for (uint32_t i = 0; ok && i < ft->ClassCount; ++i)
+	{
+		FmlFlatClass fc = ft->Classes[i];
+		fc.NameSymbol = 0;
+		ok = fwrite(&fc, sizeof(fc), 1, f) == 1;
+	}
+
+	ok = ok && Pad(f, offsets[1] + ft->ClassCount * sizeof(FmlFlatClass), offsets[2]);
+
+	for (uint32_t i = 0; ok && i < ft->AttributeCount; ++i)
+	{
+		FmlFlatAttribute fa = ft->Attributes[i];
+		fa.KeySymbol = 0;
+		ok = fwrite(&fa, sizeof(fa), 1, f) == 1;
+	}
+
+	ok = ok && Pad(f, offsets[2] + ft->AttributeCount * sizeof(FmlFlatAttribute), offsets[3]);
+
+	if (ok && ft->StringsSize > 0)
+		ok = fwrite(ft->Strings, 1, ft->StringsSize, f) == ft->StringsSize;
+
+	return ok && Pad(f, offsets[3] + ft->StringsSize, size);
+}
+
+bool FmlWriteFlatImage(FmlFlatTree const * ft, uint64_t sourceHash, char const * path)
+{
+	static char const suffix[] = ".XXXXXX";
+	size_t const len = strlen(path);
+	char * tmp = malloc(len + sizeof(suffix));
+
+	if (tmp == NULL)
+		return false;
+
+	//	A name of its own, in the same directory so it can be renamed over
+	//	the image, as several processes may be writing it at once.
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, suffix, sizeof(suffix));
+
+	int const fd = mkstemp(tmp);
+	FILE * f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+
+	if (fd >= 0 && f == NULL)
+		close(fd);
+
+	bool ok = f != NULL && WriteImage(f, ft, sourceHash);
+
+	if (f != NULL && fclose(f) != 0)
+		ok = false;
+
+	ok = ok && rename(tmp, path) == 0;
+
+	if (!ok && fd >= 0)
+	{
+		int const er = errno;
+		remove(tmp);
+		errno = er;
+	}
+
+	free(tmp);
+
+	return ok;
+}
+
+//	Everything in an image is checked before it's used, so a corrupt one is
+//	only ever turned down, and walking the tree can't go out of bounds.
+
+//	Empty strings may be {0, 0} with nothing behind them (like a missing ID);
+//	others have to be followed by their terminator.
+static bool CheckString(FmlFlatTree const * ft, FmlFlatString str)
+{
+	if (str.Offset == 0 && str.Length == 0)
+		return true;
+
+	return str.Offset < ft->StringsSize && str.Length < ft->StringsSize - str.Offset
+		&& ft->Strings[str.Offset + str.Length] == '\0';
+}
+
+static bool CheckRange(uint32_t first, uint32_t count, uint32_t total)
+{
+	return first <= total && count <= total - first;
+}
+
+static bool CheckImage(FmlFlatTree const * ft)
+{
+	for (uint32_t i = 0; i < ft->NodeCount; ++i)
+	{
+		FmlFlatNode const * const fn = ft->Nodes + i;
+
+		if (fn->Start > fn->End || !CheckString(ft, fn->Name) || !CheckString(ft, fn->Id)
+			|| !CheckRange(fn->FirstClass, fn->ClassCount, ft->ClassCount)
+			|| !CheckRange(fn->FirstAttribute, fn->AttributeCount, ft->AttributeCount))
+			return false;
+
+		switch (fn->BodyType)
+		{
+		case NBT_NONE:
+		case NBT_EXPANDED:
+		case NBT_LAZY:
+			break;
+
+		//	Children always come after their parent, so there are no cycles.
+		case NBT_CHILDREN:
+			if (fn->FirstChild <= i || !CheckRange(fn->FirstChild, fn->ChildCount, ft->NodeCount))
+				return false;
+			break;
+
+		case NBT_DOCUMENT:
+			if (!CheckString(ft, fn->Document))
+				return false;
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	for (uint32_t i = 0; i < ft->ClassCount; ++i)
+		if (ft->Classes[i].Start > ft->Classes[i].End || !CheckString(ft, ft->Classes[i].Name))
+			return false;
+
+	for (uint32_t i = 0; i < ft->AttributeCount; ++i)
+	{
+		FmlFlatAttribute const * const fa = ft->Attributes + i;
+
+		if (fa->Start > fa->End || !CheckString(ft, fa->Key))
+			return false;
+
+		switch (fa->ValueType)
+		{
+		case AVT_STRING:
+		case AVT_IDENTIFIER:
+		case AVT_REFERENCE:
+			if (!CheckString(ft, fa->sValue))
+				return false;
+			break;
+
+		case AVT_NONE:
+		case AVT_INTEGER:
+		case AVT_FLOAT:
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+FmlFlatTree * FmlMapFlatImage(char const * path, uint64_t sourceHash)
+{
+	int const fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	void * mapping = MAP_FAILED;
+
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ImageHeader))
+		mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	close(fd);
+
+	if (mapping == MAP_FAILED)
+		return NULL;
+
+	ImageHeader const * const h = mapping;
+	size_t offsets[4];
+	FmlFlatTree * ft = NULL;
+
+	if (h->Magic == IMAGE_MAGIC && h->Version == IMAGE_VERSION
+		&& h->NodeSize == sizeof(FmlFlatNode) && h->ClassSize == sizeof(FmlFlatClass)
+		&& h->AttributeSize == sizeof(FmlFlatAttribute)
+		&& h->SourceHash == sourceHash && h->RootCount <= h->NodeCount
+		&& LayOutImage(h, offsets) == (size_t)st.st_size)
+		ft = calloc(1, sizeof(FmlFlatTree));
+
+	if (ft == NULL)
+	{
+		munmap(mapping, (size_t)st.st_size);
+		return NULL;
+	}
+
+	//	Empty arrays are null, as in a tree that's just been flattened.
+	char * const base = mapping;
+	*ft = (FmlFlatTree){
+		.Nodes = h->NodeCount > 0 ? (FmlFlatNode *)(base + offsets[0]) : NULL,
+		.NodeCount = h->NodeCount,
+		.RootCount = h->RootCount,
+		.Classes = h->ClassCount > 0 ? (FmlFlatClass *)(base + offsets[1]) : NULL,
+		.ClassCount = h->ClassCount,
+		.Attributes = h->AttributeCount > 0 ? (FmlFlatAttribute *)(base + offsets[2]) : NULL,
+		.AttributeCount = h->AttributeCount,
+		.Strings = h->StringsSize > 0 ? base + offsets[3] : NULL,
+		.StringsSize = h->StringsSize,
+		.mapping = mapping,
+		.mappingSize = (size_t)st.st_size,
+	};
+
+	if (!CheckImage(ft))
+	{
+		FmlFreeFlatTree(ft);
+		return NULL;
+	}
+
+	return ft;
+}
+
+FmlFlatTree * FmlLoadFlat(char const * path, char const * str, size_t len, LexerErrorSink lers, ParserErrorSink pers, ParserOptions const * opts)
+{
+	uint64_t const hash = FmlHashSource(str, len);
+	FmlFlatTree * ft = FmlMapFlatImage(path, hash);
+
+	if (ft != NULL)
+		return ft;
+
+	//	No symbols are filled in, so the tree is the same either way.
+	ParserOptions o = opts != NULL ? *opts : (ParserOptions){ 0 };
+	o.Symbols = NULL;
+	o.IndexClasses = false;
+
+	LexerOptions const lopts = { .Flags = LF_READ_ONLY };
+	LexerState * l = LexEx(str, len, lers, &lopts);
+
+	if (l == NULL)
+		return NULL;
+
+	ft = FmlParseFlat(l, pers, &o);
+	FreeLexerState(l);
+
+	//	The image is only a cache, so failing to write it is no failure.
+	if (ft != NULL)
+		(void)FmlWriteFlatImage(ft, hash, path);
+
+	return ft;
+}
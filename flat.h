@@ -0,0 +1,125 @@
+#pragma once
+
+#include "parser.h"
+
+//	A compact, read-only form of a parsed document.
+//	Nodes, classes and attributes sit in one array each, and refer to each
+//	other by index; the children of a node are a contiguous range of nodes,
+//	and so are the top-level nodes, which come first. Offsets are 32-bit.
+//	All the text is copied into a single pool, once per distinct string, so the
+//	tree doesn't depend on the lexer or parser it came from.
+
+//	A null-terminated string in the tree's pool.
+typedef struct FmlFlatString_s
+{
+	uint32_t Offset, Length;
+} FmlFlatString;
+
+typedef struct FmlFlatClass_s
+{
+	uint32_t Start, End;
+
+	FmlFlatString Name;
+	FmlSymbol NameSymbol;
+} FmlFlatClass;
+
+typedef struct FmlFlatAttribute_s
+{
+	uint32_t Start, End;
+
+	FmlFlatString Key;
+	FmlSymbol KeySymbol;
+
+	uint8_t ValueType;			//	enum ATTRIBUTE_VALUE_TYPES
+
+	union
+	{
+		FmlFlatString sValue;	//	AVT_STRING, AVT_IDENTIFIER, AVT_REFERENCE
+		long long int lValue;	//	AVT_INTEGER
+		double dValue;			//	AVT_FLOAT
+	};
+} FmlFlatAttribute;
+
+typedef struct FmlFlatNode_s
+{
+	uint32_t Start, End;
+
+	FmlFlatString Name;
+	FmlSymbol NameSymbol;
+
+	FmlFlatString Id;			//	Empty when there is none.
+
+	uint32_t FirstClass, ClassCount;
+	uint32_t FirstAttribute, AttributeCount;
+
+	uint8_t BodyType;			//	enum NODE_BODY_TYPES
+
+	union
+	{
+		struct					//	NBT_CHILDREN
+		{
+			uint32_t FirstChild, ChildCount;
+		};
+
+		FmlFlatString Document;	//	NBT_DOCUMENT
+	};
+} FmlFlatNode;
+
+typedef struct FmlFlatTree_s
+{
+	FmlFlatNode * Nodes;		//	The top-level ones are [0, RootCount).
+	uint32_t NodeCount, RootCount;
+
+	FmlFlatClass * Classes;
+	uint32_t ClassCount;
+
+	FmlFlatAttribute * Attributes;
+	uint32_t AttributeCount;
+
+	char * Strings;
+	uint32_t StringsSize;
+
+	void * mapping;				//	Only for trees mapped from an image.
+	size_t mappingSize;
+} FmlFlatTree;
+
+//	Returns null if there's no memory, or the tree is too large to flatten.
+//	Bodies which haven't been loaded stay NBT_LAZY, without children.
+FmlFlatTree * FmlFlattenTree(ParserState const * p);
+
+//	Parses straight into a flat tree; the intermediate one lives in an arena
+//	of its own (`opts->Arena` is not used), which is dropped at the end.
+FmlFlatTree * FmlParseFlat(LexerState const * l, ParserErrorSink ers, ParserOptions const * opts);
+
+void FmlFreeFlatTree(FmlFlatTree * ft);
+
+//	An image is a flat tree saved as it is in memory, so it can be mapped back
+//	in, with no parsing and nothing to allocate other than the tree itself.
+//	It's tied to the source text it came from by a hash, and it only suits the
+//	kind of machine that wrote it. Symbols belong to tables which aren't saved,
+//	so they're all 0 in the image.
+
+uint64_t FmlHashSource(char const * str, size_t len);
+
+//	The image is written to a new file next to `path` and then moved over it,
+//	so it's never seen half-written. Returns false on failure, leaving errno
+//	set.
+bool FmlWriteFlatImage(FmlFlatTree const * ft, uint64_t sourceHash, char const * path);
+
+//	Returns null if the image can't be read, or is malformed, or was made from
+//	another source. Every index and string in it is checked, so a corrupt
+//	image is turned down rather than trusted, but positions can't be checked
+//	against a source that isn't at hand. The tree is read-only.
+FmlFlatTree * FmlMapFlatImage(char const * path, uint64_t sourceHash);
+
+//	Maps the image of `str` if there's an up-to-date one at `path`; otherwise
+//	parses `str`, reporting any errors, and (re)writes the image. Errors are
+//	not kept in the image, so they're only reported when the source is parsed.
+//	The symbol table in the options isn't used, so the tree is the same either
+//	way.
+FmlFlatTree * FmlLoadFlat(char const * path, char const * str, size_t len, LexerErrorSink lers, ParserErrorSink pers, ParserOptions const * opts);
+
+static inline char const * FmlFlatChars(FmlFlatTree const * ft, FmlFlatString str)
+{
+	return ft->Strings + str.Offset;
+}
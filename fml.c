@@ -3,6 +3,10 @@
 #include "beautifier.h"
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 struct PrintContext
 {
@@ -41,7 +45,7 @@ static void PrintIndent(struct PrintContext * pc, bool beginning)
 static void PrintNode(struct PrintContext * pc)
 {
 	PrintIndent(pc, true);
-	fprintf(pc->Output, " Node \"%s\"\n", pc->Node->Name);
+	fprintf(pc->Output, " Node \"%.*s\"\n", (int)pc->Node->NameLength, pc->Node->Name);
 
 	if (pc->Node->Classes)
 	{
@@ -49,10 +53,10 @@ static void PrintNode(struct PrintContext * pc)
 		fputs("  Classes: ", pc->Output);
 
 		Class const * cl = pc->Node->Classes;
-		fputs(cl->Name, pc->Output);
+		fwrite(cl->Name, 1, cl->NameLength, pc->Output);
 
 		while ((cl = cl->Next) != NULL)
-			fprintf(pc->Output, ", %s", cl->Name);
+			fprintf(pc->Output, ", %.*s", (int)cl->NameLength, cl->Name);
 
 		putc('\n', pc->Output);
 	}
@@ -60,7 +64,7 @@ static void PrintNode(struct PrintContext * pc)
 	if (pc->Node->Id)
 	{
 		PrintIndent(pc, false);
-		fprintf(pc->Output, "  Id: %s\n", pc->Node->Id);
+		fprintf(pc->Output, "  Id: %.*s\n", (int)pc->Node->IdLength, pc->Node->Id);
 	}
 
 	if (pc->Node->Attributes)
@@ -76,7 +80,7 @@ static void PrintNode(struct PrintContext * pc)
 			PrintIndent(&spc, true);
 
 			putc(' ', pc->Output);
-			fputs(at->Key, pc->Output);
+			fwrite(at->Key, 1, at->KeyLength, pc->Output);
 
 			switch (at->ValueType)
 			{
@@ -84,13 +88,13 @@ static void PrintNode(struct PrintContext * pc)
 				fputs(" (no value)\n", pc->Output);
 				break;
 			case AVT_STRING:
-				fprintf(pc->Output, " = \"%s\" (string)\n", at->sValue);
+				fprintf(pc->Output, " = \"%.*s\" (string)\n", (int)at->sLength, at->sValue);
 				break;
 			case AVT_IDENTIFIER:
-				fprintf(pc->Output, " = %s (identifier)\n", at->sValue);
+				fprintf(pc->Output, " = %.*s (identifier)\n", (int)at->sLength, at->sValue);
 				break;
 			case AVT_REFERENCE:
-				fprintf(pc->Output, " = $%s (reference)\n", at->sValue);
+				fprintf(pc->Output, " = $%.*s (reference)\n", (int)at->sLength, at->sValue);
 				break;
 			case AVT_INTEGER:
 				fprintf(pc->Output, " = %llu (integer)\n", at->lValue);
@@ -107,9 +111,9 @@ static void PrintNode(struct PrintContext * pc)
 		PrintIndent(pc, false);
 		fprintf(pc->Output, "  Document:\n"
 			"--------------------------------------------------------------------------------\n"
-			"%s\n"
+			"%.*s\n"
 			"--------------------------------------------------------------------------------\n"
-			, pc->Node->Document);
+			, (int)pc->Node->DocumentLength, pc->Node->Document);
 	}
 	else if (pc->Node->BodyType == NBT_CHILDREN)
 	{
@@ -162,35 +166,38 @@ int main(int argc, char * * argv)
 	(void)argc;
 	(void)argv;
 
-	FILE * fIn = fopen("test.fml", "r");
-	if (!fIn) phail();
+	int const fdIn = open("test.fml", O_RDONLY);
+	if (fdIn < 0) phail();
 
 #define PHAIL if (res != 0) phail();
 
-	int res = fseek(fIn, 0, SEEK_END);
+	struct stat st;
+	int res = fstat(fdIn, &st);
 	PHAIL
 
-	size_t const cnt = ftell(fIn);
-	char * const str = malloc(cnt + 1);
+	//	The file is lexed straight from a read-only mapping.
+	size_t const cnt = (size_t)st.st_size;
+	char const * str = "";
 
-	res = fseek(fIn, 0, SEEK_SET);
-	PHAIL
-	fread(str, 1, cnt, fIn);
-	PHAIL
-	str[cnt] = '\0';
+	if (cnt > 0 && (str = mmap(NULL, cnt, PROT_READ, MAP_PRIVATE, fdIn, 0)) == MAP_FAILED)
+		phail();
 
-	res = fclose(fIn);
+	res = close(fdIn);
 	PHAIL
 
 	printf("%zd characters\n", cnt);
-	fputs(str, stdout);
+	fwrite(str, 1, cnt, stdout);
 
-	LexerState * l = Lex(str, cnt, &ReportLexerErrorDefault);
+	long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	LexerOptions const lopts = { .Flags = LF_READ_ONLY, .Threads = cpus > 1 ? (unsigned)cpus : 1 };
+	LexerState * l = LexEx(str, cnt, &ReportLexerErrorDefault, &lopts);
 
 	puts("Finished lexing.");
 
-	for (Token const * tk = l->Tokens; tk != NULL; tk = tk->Next)
+	for (size_t i = 0; i < l->Tokens.Count; ++i)
 	{
+		Token const tkv = FmlGetToken(&(l->Tokens), i), * tk = &tkv;
+
 		putchar('[');
 
 		switch (tk->Type)
@@ -219,7 +226,7 @@ int main(int argc, char * * argv)
 		switch (tk->Type)
 		{
 		case TT_IDENTIFIER: case TT_STRING:
-			printf("; %s]\n", tk->sValue);
+			printf("; %.*s]\n", (int)tk->sLength, tk->sValue);
 			break;
 
 		case TT_INTEGER:
@@ -231,7 +238,7 @@ int main(int argc, char * * argv)
 			break;
 
 		case TT_DOCUMENT:
-			printf("; %s]\n", tk->sValue);
+			printf("; %.*s]\n", (int)tk->sLength, tk->sValue);
 			break;
 
 		default:
@@ -240,7 +247,8 @@ int main(int argc, char * * argv)
 		}
 	}
 
-	ParserState * p = Parse(l, ReportParserErrorDefault);
+	ParserOptions const popts = { .Threads = lopts.Threads };
+	ParserState * p = ParseEx(l, ReportParserErrorDefault, &popts);
 
 	PrintParserState(p, stdout);
 
@@ -255,7 +263,9 @@ int main(int argc, char * * argv)
 
 	FreeParserState(p);
 	FreeLexerState(l);
-	free(str);
+
+	if (cnt > 0)
+		munmap((void *)str, cnt);
 
 #undef PHAIL
 
@@ -0,0 +1,374 @@
+#include "index.h"
+#include <string.h>
+
+FmlIdIndex * FmlCreateIdIndex(void)
+{
+	return calloc(1, sizeof(FmlIdIndex));
+}
+
+void FmlFreeIdIndex(FmlIdIndex * idx)
+{
+	free(idx->Slots);
+	free(idx);
+}
+
+//	Returns the slot which holds the ID, or the empty one where it'd go.
+static struct FmlIdSlot_s * FindIdSlot(FmlIdIndex const * idx, char const * id, size_t len, uint32_t hash)
+{
+	size_t const mask = idx->SlotCount - 1;
+
+	for (size_t i = hash & mask; /* nothing */; i = (i + 1) & mask)
+	{
+		struct FmlIdSlot_s * const slot = idx->Slots + i;
+
+		if (slot->Node == NULL
+			|| (slot->Hash == hash && slot->Length == len
+				&& memcmp(slot->Id, id, len) == 0))
+			return slot;
+	}
+}
+
+//	Keeps the table at most half full.
+static bool GrowIdSlots(FmlIdIndex * idx)
+{
+	size_t const newCount = idx->SlotCount < 64 ? 64 : idx->SlotCount * 2;
+	struct FmlIdSlot_s * slots = calloc(newCount, sizeof(struct FmlIdSlot_s));
+
+	if (slots == NULL)
+		return false;
+
+	for (size_t i = 0; i < idx->SlotCount; ++i)
+	{
+		struct FmlIdSlot_s const slot = idx->Slots[i];
+
+		if (slot.Node == NULL)
+			continue;
+
+		size_t j = slot.Hash & (newCount - 1);
+
+		while (slots[j].Node != NULL)
+			j = (j + 1) & (newCount - 1);
+
+		slots[j] = slot;
+	}
+
+	free(idx->Slots);
+	idx->Slots = slots;
+	idx->SlotCount = newCount;
+
+	return true;
+}
+
+Node * FmlAddId(FmlIdIndex * idx, Node * n)
+{
+	if ((idx->Count + 1) * 2 > idx->SlotCount && !GrowIdSlots(idx))
+		return NULL;
+
+	if (n->IdLength > UINT32_MAX)
+		return NULL;
+
+	uint32_t const hash = FmlHashName(n->Id, n->IdLength);
+	struct FmlIdSlot_s * const slot = FindIdSlot(idx, n->Id, n->IdLength, hash);
+
+	if (slot->Node != NULL)
+	{
+		++idx->Duplicates;
+
+		return slot->Node;
+	}
+
+	*slot = (struct FmlIdSlot_s){ hash, (uint32_t)(n->IdLength), n->Id, n };
+	++idx->Count;
+
+	return n;
+}
+
+Node * FmlFindInIdIndex(FmlIdIndex const * idx, char const * id, size_t len)
+{
+	if (idx->SlotCount == 0)
+		return NULL;
+
+	return FindIdSlot(idx, id, len, FmlHashName(id, len))->Node;
+}
+
+//	Stops early when `visit` returns false, and returns false then.
+static bool WalkTree(ParserState * p, bool (*visit)(ParserState * p, Node * n))
+{
+	for (Node * n = p->Nodes; n != NULL; n = FmlNextNode(n))
+		if (!visit(p, n))
+			return false;
+
+	return true;
+}
+
+//	Returns the token which starts at `loc`, which there has to be.
+static size_t FindTokenAt(TokenStream const * ts, size_t loc)
+{
+	size_t lo = 0, hi = ts->Count - 1;
+
+	while (lo < hi)
+	{
+		size_t const mid = lo + (hi - lo) / 2;
+
+		if (ts->Starts[mid] < loc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+void FmlReportDuplicateId(ParserState * p, Node const * n)
+{
+	TokenStream const * const ts = &(p->lexer->Tokens);
+	size_t const loc = (size_t)(n->Id - p->lexer->Buffer);
+
+	//	Tokens pulled from the lexer aren't kept, but an ID is never escaped,
+	//	so its token ends on its last character.
+	if (ts->Count == 0)
+	{
+		p->ErrorSink(p, loc, n->IdLength - 1, "Duplicate ID.");
+		return;
+	}
+
+	size_t const tk = FindTokenAt(ts, loc);
+
+	p->ErrorSink(p, ts->Starts[tk], ts->Ends[tk] - ts->Starts[tk], "Duplicate ID.");
+}
+
+static bool IndexId(ParserState * p, Node * n)
+{
+	if (n->Id == NULL)
+		return true;
+
+	Node * const first = FmlAddId(p->Ids, n);
+
+	if (first == NULL)
+		return false;
+
+	if (first != n)
+		FmlReportDuplicateId(p, n);
+
+	return true;
+}
+
+FmlIdIndex * FmlGetIdIndex(ParserState * p)
+{
+	if (p->Ids != NULL)
+		return p->Ids;
+
+	if ((p->Ids = FmlCreateIdIndex()) == NULL)
+		return NULL;
+
+	if (!WalkTree(p, IndexId))
+	{
+		FmlFreeIdIndex(p->Ids);
+		p->Ids = NULL;
+	}
+
+	return p->Ids;
+}
+
+Node * FmlFindById(ParserState * p, char const * id, size_t len)
+{
+	FmlIdIndex const * const idx = FmlGetIdIndex(p);
+
+	return idx != NULL ? FmlFindInIdIndex(idx, id, len) : NULL;
+}
+
+void FmlClearNodeList(FmlNodeList * list)
+{
+	free(list->Nodes);
+	*list = (FmlNodeList){ 0 };
+}
+
+bool FmlAddToNodeList(FmlNodeList * list, Node * n)
+{
+	if (list->Count == list->Capacity)
+	{
+		size_t const newCap = list->Capacity < 4 ? 4 : list->Capacity * 2;
+		Node * * nodes = realloc(list->Nodes, newCap * sizeof(Node *));
+
+		if (nodes == NULL)
+			return false;
+
+		list->Nodes = nodes;
+		list->Capacity = newCap;
+	}
+
+	list->Nodes[list->Count++] = n;
+
+	return true;
+}
+
+FmlClassIndex * FmlCreateClassIndex(void)
+{
+	return calloc(1, sizeof(FmlClassIndex));
+}
+
+void FmlFreeClassIndex(FmlClassIndex * idx)
+{
+	for (size_t i = 0; i < idx->ListCount; ++i)
+		free(idx->Lists[i].Nodes);
+
+	free(idx->Lists);
+	free(idx);
+}
+
+bool FmlAddClass(FmlClassIndex * idx, FmlSymbol cls, Node * n)
+{
+	if (cls == 0)
+		return false;
+
+	if (cls >= idx->ListCount)
+	{
+		size_t newCount = idx->ListCount < 256 ? 256 : idx->ListCount;
+
+		while (newCount <= cls)
+			newCount *= 2;
+
+		FmlNodeList * lists = realloc(idx->Lists, newCount * sizeof(FmlNodeList));
+
+		if (lists == NULL)
+			return false;
+
+		memset(lists + idx->ListCount, 0, (newCount - idx->ListCount) * sizeof(FmlNodeList));
+		idx->Lists = lists;
+		idx->ListCount = newCount;
+	}
+
+	FmlNodeList * const list = idx->Lists + cls;
+
+	//	A node may repeat a class.
+	if (list->Count > 0 && list->Nodes[list->Count - 1] == n)
+		return true;
+
+	return FmlAddToNodeList(list, n);
+}
+
+static bool IndexClasses(ParserState * p, Node * n)
+{
+	for (Class * cl = n->Classes; cl != NULL; cl = cl->Next)
+	{
+		if (cl->NameSymbol == 0)
+			cl->NameSymbol = FmlIntern(p->Symbols, cl->Name, cl->NameLength);
+
+		if (!FmlAddClass(p->Classes, cl->NameSymbol, n))
+			return false;
+	}
+
+	return true;
+}
+
+FmlClassIndex * FmlGetClassIndex(ParserState * p)
+{
+	if (p->Classes != NULL)
+		return p->Classes;
+
+	if (p->Symbols == NULL)
+	{
+		if ((p->Symbols = FmlCreateSymbolTable()) == NULL)
+			return NULL;
+
+		p->OwnsSymbols = true;
+	}
+
+	if ((p->Classes = FmlCreateClassIndex()) == NULL)
+		return NULL;
+
+	if (!WalkTree(p, IndexClasses))
+	{
+		FmlFreeClassIndex(p->Classes);
+		p->Classes = NULL;
+	}
+
+	return p->Classes;
+}
+
+static FmlNodeList const * GetClassList(FmlClassIndex const * idx, FmlSymbol cls)
+{
+	return cls != 0 && cls < idx->ListCount && idx->Lists[cls].Count > 0
+		? idx->Lists + cls
+		: NULL;
+}
+
+FmlNodeList const * FmlFindByClass(ParserState * p, char const * name, size_t len)
+{
+	FmlClassIndex const * const idx = FmlGetClassIndex(p);
+
+	return idx != NULL ? GetClassList(idx, FmlFindSymbol(p->Symbols, name, len)) : NULL;
+}
+
+//	Returns the index of the first node in [lo, Count) which doesn't come
+//	before `offset`. Nodes start in document order.
+static size_t LowerBound(FmlNodeList const * list, size_t lo, size_t offset)
+{
+	size_t hi = list->Count;
+
+	while (lo < hi)
+	{
+		size_t const mid = lo + (hi - lo) / 2;
+
+		if (list->Nodes[mid]->Start < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+bool FmlIntersectClasses(ParserState * p, FmlSymbol const * classes, size_t count, FmlNodeList * res)
+{
+	FmlClassIndex const * const idx = FmlGetClassIndex(p);
+
+	if (idx == NULL)
+		return false;
+
+	res->Count = 0;
+
+	FmlNodeList const * rarest = NULL;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		FmlNodeList const * const list = GetClassList(idx, classes[i]);
+
+		if (list == NULL)
+			return true;
+
+		if (rarest == NULL || list->Count < rarest->Count)
+			rarest = list;
+	}
+
+	if (rarest == NULL)
+		return true;
+
+	for (size_t i = 0; i < rarest->Count; ++i)
+		if (!FmlAddToNodeList(res, rarest->Nodes[i]))
+			return false;
+
+	//	The candidates are whittled down by each other list in turn; as they
+	//	are in document order, the searches only ever move forward.
+	for (size_t i = 0; i < count && res->Count > 0; ++i)
+	{
+		FmlNodeList const * const list = GetClassList(idx, classes[i]);
+		size_t lo = 0, kept = 0;
+
+		if (list == rarest)
+			continue;
+
+		for (size_t j = 0; j < res->Count; ++j)
+		{
+			Node * const n = res->Nodes[j];
+			lo = LowerBound(list, lo, n->Start);
+
+			if (lo < list->Count && list->Nodes[lo] == n)
+				res->Nodes[kept++] = n;
+		}
+
+		res->Count = kept;
+	}
+
+	return true;
+}
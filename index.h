@@ -0,0 +1,86 @@
+#pragma once
+
+#include "parser.h"
+
+//	Maps the IDs of a document to their nodes.
+//	When an ID is given to several nodes, the first one (in document order)
+//	is the one indexed, and the others are reported as duplicates.
+typedef struct FmlIdIndex_s
+{
+	struct FmlIdSlot_s
+	{
+		uint32_t Hash, Length;
+		char const * Id;	//	Kept here so lookups don't go through the node.
+		Node * Node;		//	Null in an empty slot.
+	} * Slots;
+
+	size_t SlotCount;	//	A power of two.
+	size_t Count;
+	size_t Duplicates;
+} FmlIdIndex;
+
+FmlIdIndex * FmlCreateIdIndex(void);
+void FmlFreeIdIndex(FmlIdIndex * idx);
+
+//	Returns the node which had the ID of `n` first (`n` itself if it's new),
+//	or null if there's no memory to add it. `n` must have an ID.
+Node * FmlAddId(FmlIdIndex * idx, Node * n);
+
+Node * FmlFindInIdIndex(FmlIdIndex const * idx, char const * id, size_t len);
+
+//	Reports `n` to the error sink as having the ID of an earlier node, at its
+//	ID token, like the parser does.
+void FmlReportDuplicateId(ParserState * p, Node const * n);
+
+//	Returns the ID index of a parser state, building it from the tree on the
+//	first call if the parser didn't (see `ParserOptions.IndexIds`).
+//	Duplicates found then are reported to the error sink.
+//	Returns null if there's no memory for it. Like the rest of the lookups
+//	here, it mustn't race with loads of lazy bodies (see `FmlLoadChildren`).
+FmlIdIndex * FmlGetIdIndex(ParserState * p);
+
+//	Returns the node with the given ID, or null if there's none.
+Node * FmlFindById(ParserState * p, char const * id, size_t len);
+
+//	A list of nodes in document order.
+typedef struct FmlNodeList_s
+{
+	Node * * Nodes;
+	size_t Count, Capacity;
+} FmlNodeList;
+
+//	Returns false if there's no memory for it.
+bool FmlAddToNodeList(FmlNodeList * list, Node * n);
+
+//	Frees the memory behind a list, leaving it empty.
+void FmlClearNodeList(FmlNodeList * list);
+
+//	Maps each class to the nodes which have it, in document order.
+//	Classes are known by their symbols, so the parser interns them.
+typedef struct FmlClassIndex_s
+{
+	FmlNodeList * Lists;	//	Indexed by symbol.
+	size_t ListCount;
+} FmlClassIndex;
+
+FmlClassIndex * FmlCreateClassIndex(void);
+void FmlFreeClassIndex(FmlClassIndex * idx);
+
+//	Nodes have to be added in document order. Returns false if there's no
+//	memory for it.
+bool FmlAddClass(FmlClassIndex * idx, FmlSymbol cls, Node * n);
+
+//	Returns the class index of a parser state, building it from the tree on
+//	the first call if the parser didn't (see `ParserOptions.IndexClasses`);
+//	class names are interned then, into a table of the parser's own if it
+//	had none. Returns null if there's no memory for it.
+FmlClassIndex * FmlGetClassIndex(ParserState * p);
+
+//	Returns the nodes with the given class, or null if there are none.
+FmlNodeList const * FmlFindByClass(ParserState * p, char const * name, size_t len);
+
+//	Fills `res` with the nodes which have all the given classes, in document
+//	order. Takes time proportional to the number of nodes with the rarest
+//	class, times the logarithm of the others'.
+//	Returns false if there's no memory for it.
+bool FmlIntersectClasses(ParserState * p, FmlSymbol const * classes, size_t count, FmlNodeList * res);
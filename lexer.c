@@ -1,27 +1,75 @@
 #include "lexer.h"
+#include "scan.h"
+#include "utils.char.h"
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
+#include <float.h>
+#include <inttypes.h>
+#include <pthread.h>
 
-static void AppendToken(LexerState * l, Token * tk)
+static bool GrowTokenStream(LexerState * l)
 {
-	tk->Next = NULL;
+	TokenStream * ts = &(l->Tokens);
+	size_t const newCap = ts->Capacity < 256 ? 256 : ts->Capacity * 2;
 
-	if (l->lastToken == NULL)
-		l->Tokens = l->lastToken = tk;
-	else
-	{
-		l->lastToken->Next = tk;
-		l->lastToken = tk;
-	}
+	uint8_t * types = FmlArenaGrow(l->Arena, ts->Types, ts->Capacity * sizeof(uint8_t), newCap * sizeof(uint8_t));
+	uint32_t * starts = FmlArenaGrow(l->Arena, ts->Starts, ts->Capacity * sizeof(uint32_t), newCap * sizeof(uint32_t));
+	uint32_t * ends = FmlArenaGrow(l->Arena, ts->Ends, ts->Capacity * sizeof(uint32_t), newCap * sizeof(uint32_t));
+	TokenValue * values = FmlArenaGrow(l->Arena, ts->Values, ts->Capacity * sizeof(TokenValue), newCap * sizeof(TokenValue));
+
+	if (types == NULL || starts == NULL || ends == NULL || values == NULL)
+		return false;
+
+	ts->Types = types;
+	ts->Starts = starts;
+	ts->Ends = ends;
+	ts->Values = values;
+	ts->Capacity = newCap;
+
+	return true;
+}
+
+static bool AppendToken(LexerState * l, Token const * tk)
+{
+	TokenStream * ts = &(l->Tokens);
+
+	if (ts->Count == ts->Capacity && !GrowTokenStream(l))
+		return false;
+
+	size_t const i = ts->Count++;
+
+	ts->Types[i] = (uint8_t)(tk->Type);
+	ts->Starts[i] = (uint32_t)(tk->Start);
+	ts->Ends[i] = (uint32_t)(tk->End);
+	ts->Values[i].sValue = tk->sValue;
+	ts->Values[i].sLength = tk->sLength;
+
+	return true;
+}
+
+//	With partial input, a token which runs into the end of the input may go on
+//	in the input which follows, so it isn't lexed yet.
+static char * NeedMoreInput(LexerState * l)
+{
+	l->needsMore = true;
+	return NULL;
 }
 
 //	This returns a pointer to the last character of an identifier
 //	in the given string.
 static char * LexIdentifier(LexerState * l, char * str, size_t len)
 {
+	char const * const end = str + len;
+
+	//	Identifier characters and complete UTF-8 sequences are skipped in bulk.
+	//	Whatever stops them is dealt with by the loop below, which also
+	//	reports any errors.
+	str = (char *)FmlSkipIdentifier(str, end);
+	len = (size_t)(end - str);
 	int leadBytesLeft = 0;
+
 	while (len-- > 0)
 	{
 		char c = *str;
@@ -76,6 +124,9 @@ static char * LexIdentifier(LexerState * l, char * str, size_t len)
 			}
 	}
 
+	if (l->partial)
+		return NeedMoreInput(l);
+
 	if (leadBytesLeft > 0)
 	{
 		l->ErrorSink(l, l->InputSize, "Unfinished UTF-8 multi-byte sequence.");
@@ -87,58 +138,137 @@ end_of_identifier:
 	return str - 1;
 }
 
+//	Exact powers of ten which doubles can hold.
+static double const PowersOfTen[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+//	Computes `mantissa` * 10^`exponent` as a double, correctly rounded.
+//	The digits of the number are taken again from [str, end) when the value
+//	cannot be computed exactly from the mantissa, which is then inexact or
+//	too large, or when the exponent is too far off.
+//	Returns false and sets errno if the number is out of range.
+static bool DecimalToDouble(char const * str, char const * end, bool negative
+	, uint64_t mantissa, bool exact, int64_t exponent, double * res)
+{
+#if FLT_EVAL_METHOD == 0
+	//	When both the mantissa and the power of ten are exact doubles, a single
+	//	multiplication or division rounds correctly (Clinger's fast path).
+	if (exact && mantissa <= ((uint64_t)1 << 53) && exponent >= -22)
+	{
+		double d = (double)mantissa;
+		int64_t e = exponent;
+
+		if (e > 22 && e <= 22 + 15)
+		{
+			//	Some of the exponent can go into the mantissa, if it stays exact.
+			d *= PowersOfTen[e - 22];
+			e = 22;
+		}
+
+		if (e <= 22 && d < 9007199254740992.0)
+		{
+			d = e < 0 ? d / PowersOfTen[-e] : d * PowersOfTen[e];
+			*res = negative ? -d : d;
+			return true;
+		}
+	}
+#endif
+
+	//	The C library does the hard cases, given the digits and the exponent
+	//	in a form which doesn't involve the locale's decimal separator.
+	char buf[128], * digits = buf, * w;
+	size_t const size = (size_t)(end - str) + 24;
+
+	if (size > sizeof(buf) && (digits = malloc(size)) == NULL)
+	{
+		errno = ENOMEM;
+		return false;
+	}
+
+	w = digits;
+
+	if (negative)
+		*w++ = '-';
+
+	for (/* nothing */; str < end && *str != 'e' && *str != 'E'; ++str)
+		if (*str >= '0' && *str <= '9')
+			*w++ = *str;
+
+	sprintf(w, "e%" PRId64, exponent);
+
+	errno = 0;
+	*res = strtod(digits, NULL);
+
+	if (digits != buf)
+		free(digits);
+
+	return errno == 0;
+}
+
 //	This returns a pointer to the last character of a number
 //	in the given string, and sets the dValue of the given token
 //	to the numeric representation of the number found here.
 static char * LexNumber(LexerState * l, char * str, size_t len)
 {
-	char * w = str, * start = str, * tail;
+	char * start = str, * numberEnd;
 	bool hasDecimalSeparator = false, hasExponent = false
 		, expectExponentSign = false, expectExponentDigit = false
-		, expectSeparatorDigit = false;
+		, expectSeparatorDigit = false
+		, negative = false, negativeExponent = false;
 	int digitCount = 0;	//	Used for binary, octal, and hexadecimal.
 	l->workingToken->lValue = 0ll;
 
-	if (*str == '+' || *str == '-')
-		++str, --len, ++w;
+	//	Decimal numbers are gathered as a mantissa of up to 19 significant
+	//	digits and a power of ten, which is adjusted for fractional digits.
+	uint64_t mantissa = 0;
+	int significantDigits = 0;
+	int64_t scale = 0, exponent = 0;
 
-	if (*str == '0' && len > 2)
+	if (*str == '+' || *str == '-')
 	{
-		char c = str[1];
-		str += 2;
-		len -= 2;
+		negative = *str == '-';
+		++str, --len;
+	}
 
-		switch (c)
-		{
-		case 'b': goto lex_binary_number;
-		case 'o': goto lex_octal_number;
-		case 'x': goto lex_hexadecimal_number;
+	//	The prefix can't be told apart without the two characters after it.
+	if (l->partial && len <= 2)
+		return NeedMoreInput(l);
 
-		//	This means decimal, and the digit is written w/o the leading 0.
-		case '1' ... '9':
-			*w++ = c;
-			goto lex_decimal_number;
+	if (len > 2 && *str == '0')
+	{
+		//	The first two characters are only consumed if they're a prefix or
+		//	part of the number; anything else is left for the decimal loop.
+		switch (str[1])
+		{
+		case 'b': str += 2; len -= 2; goto lex_binary_number;
+		case 'o': str += 2; len -= 2; goto lex_octal_number;
+		case 'x': str += 2; len -= 2; goto lex_hexadecimal_number;
 
-			//	Dot, 'e' and 'E' mean float, and the two characters here are needed.
+			//	Dot, 'e' and 'E' mean float.
 		case '.':
 			l->workingToken->Type = TT_FLOAT;
 			hasDecimalSeparator = true;
-			w += 2;
-			goto lex_decimal_number;
+			str += 2;
+			len -= 2;
+			break;
 
 		case 'e': case 'E':
 			l->workingToken->Type = TT_FLOAT;
-			hasExponent = expectExponentSign = true;
-			w += 2;
-			goto lex_decimal_number;
+			hasExponent = expectExponentSign = expectExponentDigit = true;
+			str += 2;
+			len -= 2;
+			break;
 
 			//	In these cases, the first two characters can be safely discarded.
 		case 'd': case '_': case '\'': case '0':
+			str += 2;
+			len -= 2;
 			break;
 		}
 	}
 
-lex_decimal_number:
 	while (len-- > 0)
 	{
 		char c = *str++;
@@ -147,7 +277,26 @@ lex_decimal_number:
 		{
 		case '0' ... '9':
 			expectExponentSign = expectExponentDigit = expectSeparatorDigit = false;
-			*w++ = c;
+
+			if (hasExponent)
+			{
+				//	Anything past this is out of range anyway.
+				if (exponent < 100000000)
+					exponent = exponent * 10 + (c - '0');
+			}
+			else
+			{
+				if (hasDecimalSeparator)
+					--scale;
+
+				//	Leading zeros aren't significant.
+				if (mantissa != 0 || c != '0')
+				{
+					if (++significantDigits <= 19)
+						mantissa = mantissa * 10 + (uint64_t)(c - '0');
+				}
+			}
+
 			break;
 
 			//	Underscores and single quotes inside numbers are just for spacing.
@@ -165,7 +314,6 @@ lex_decimal_number:
 
 			l->workingToken->Type = TT_FLOAT;
 			hasDecimalSeparator = expectSeparatorDigit = true;
-			*w++ = c;
 			break;
 
 		case 'e': case 'E':
@@ -184,7 +332,6 @@ lex_decimal_number:
 
 			l->workingToken->Type = TT_FLOAT;
 			hasExponent = expectExponentSign = expectExponentDigit = true;
-			*w++ = c;
 			break;
 
 		case '+': case '-':
@@ -197,11 +344,13 @@ lex_decimal_number:
 			}
 
 			expectExponentSign = false;
-			*w++ = c;
+			negativeExponent = c == '-';
 			break;
 
 		case '\0':
-			if (len > 0)
+			if (len == 0 && l->partial)
+				return NeedMoreInput(l);
+			else if (len > 0)
 			{
 				l->ErrorSink(l, (size_t)(str - 1 - l->Buffer), "Unexpected null character before end of input.");
 				return NULL;
@@ -209,6 +358,8 @@ lex_decimal_number:
 			//	Else fallthrough.
 
 		case ' ': case '\t': case '\n': case '\r':
+			numberEnd = str - 1;
+
 		end_of_decimal_number:
 			if (expectExponentDigit)
 			{
@@ -221,43 +372,25 @@ lex_decimal_number:
 				return NULL;
 			}
 
-			if (l->workingToken->Type == TT_INTEGER)
+			if (l->workingToken->Type == TT_INTEGER && significantDigits <= 19
+				&& mantissa <= (negative ? (uint64_t)LLONG_MAX + 1 : (uint64_t)LLONG_MAX))
 			{
-				errno = 0;	//	This has to be cleared manually...
-				l->workingToken->lValue = strtoll(start, &tail, 10);
-
-				if ((l->workingToken->lValue == LLONG_MIN || l->workingToken->lValue == LLONG_MAX) && errno == ERANGE)
-					goto lex_decimal_as_double;
-
-				if (errno != 0)
-				{
-					l->ErrorSink(l, (size_t)(start - l->Buffer), "Failed to parse decimal number.");
-					l->ErrorSink(l, (size_t)(start - l->Buffer), strerror(errno));
-					return NULL;
-				}
-				else if (tail != str - 1)
-				{
-					l->ErrorSink(l, (size_t)(start - l->Buffer), "Failed to parse decimal number.");
-					return NULL;
-				}
+				l->workingToken->lValue = negative && mantissa != 0
+					? -(long long)(mantissa - 1) - 1
+					: (long long)mantissa;
 			}
 			else
 			{
-			lex_decimal_as_double:
-				errno = 0;	//	Might be needed again.
-				l->workingToken->dValue = strtod(start, &tail);
+				//	Integers which don't fit become floats.
+				l->workingToken->Type = TT_FLOAT;
 
-				if (errno != 0)
+				if (!DecimalToDouble(start, numberEnd, negative, mantissa, significantDigits <= 19
+					, (negativeExponent ? -exponent : exponent) + scale, &(l->workingToken->dValue)))
 				{
 					l->ErrorSink(l, (size_t)(start - l->Buffer), "Failed to parse decimal number.");
 					l->ErrorSink(l, (size_t)(start - l->Buffer), strerror(errno));
 					return NULL;
 				}
-				else if (tail != str - 1)
-				{
-					l->ErrorSink(l, (size_t)(start - l->Buffer), "Failed to parse decimal number.");
-					return NULL;
-				}
 			}
 
 			return str - 1;
@@ -272,6 +405,10 @@ lex_decimal_number:
 	}
 
 	//	Reaching this point means the end of the string was encountered.
+	if (l->partial)
+		return NeedMoreInput(l);
+
+	numberEnd = str;
 	goto end_of_decimal_number;
 
 lex_binary_number:
@@ -309,7 +446,9 @@ lex_binary_number:
 			break;
 
 		case '\0':
-			if (len > 0)
+			if (len == 0 && l->partial)
+				return NeedMoreInput(l);
+			else if (len > 0)
 			{
 				l->ErrorSink(l, (size_t)(str - 1 - l->Buffer), "Unexpected null character before end of input.");
 				return NULL;
@@ -332,6 +471,9 @@ lex_binary_number:
 		}
 	}
 
+	if (l->partial)
+		return NeedMoreInput(l);
+
 	goto end_of_binary_number;
 
 lex_octal_number:
@@ -370,7 +512,9 @@ lex_octal_number:
 			break;
 
 		case '\0':
-			if (len > 0)
+			if (len == 0 && l->partial)
+				return NeedMoreInput(l);
+			else if (len > 0)
 			{
 				l->ErrorSink(l, (size_t)(str - 1 - l->Buffer), "Unexpected null character before end of input.");
 				return NULL;
@@ -393,6 +537,9 @@ lex_octal_number:
 		}
 	}
 
+	if (l->partial)
+		return NeedMoreInput(l);
+
 	goto end_of_octal_number;
 
 lex_hexadecimal_number:
@@ -442,7 +589,9 @@ lex_hexadecimal_number:
 			break;
 
 		case '\0':
-			if (len > 0)
+			if (len == 0 && l->partial)
+				return NeedMoreInput(l);
+			else if (len > 0)
 			{
 				l->ErrorSink(l, (size_t)(str - 1 - l->Buffer), "Unexpected null character before end of input.");
 				return NULL;
@@ -465,41 +614,109 @@ lex_hexadecimal_number:
 		}
 	}
 
+	if (l->partial)
+		return NeedMoreInput(l);
+
 	goto end_of_hexadecimal_number;
 }
 
+//	Read-only input can't be unescaped in place, so a string is moved to the
+//	arena once its text has to shift, at `str`: when an escape sequence or
+//	a character skipped over after an error is found there. The block is as
+//	large as the rest of the string in the input, which is as long as the
+//	resulting text can get.
+//	This returns the write pointer for the rest of the string.
+static char * MoveStringToArena(LexerState * l, char const * str, char const * end, char const * w)
+{
+	char const * s;
+
+	//	The string ends at the first quote after an even number of backslashes.
+	for (s = str; (s = FmlFindByte(s, end, '"')) < end; ++s)
+	{
+		char const * b = s;
+
+		while (b > str && b[-1] == '\\')
+			--b;
+
+		if (((s - b) & 1) == 0)
+			break;
+	}
+
+	size_t const done = (size_t)(w - l->workingToken->sValue);
+	char * res = FmlArenaAlloc(l->Arena, done + (size_t)(s - str) + 1);
+
+	if (res == NULL)
+		return NULL;
+
+	memcpy(res, l->workingToken->sValue, done);
+	l->workingToken->sValue = res;
+
+	return res + done;
+}
+
 //	This returns a pointer to the final unescaped double quotes
 //	of a string.
 static char * LexString(LexerState * l, char * str, size_t len)
 {
-	bool inEscape = false;
+	bool inEscape = false, moved = false;
 	char * w = str;
+	char const * const end = str + len;
 	int leadBytesLeft = 0;
 
-	while (len-- > 0)
+	//	While the text is still in place, characters are already where they
+	//	belong, and read-only input mustn't be written to anyway.
+#define KEEP_CHAR() do { if (w != str) *w = *str; ++w; } while (false)
+
+	//	Dropping a character shifts the rest of the text.
+#define DROP_CHAR() do \
+	{ \
+		if ((l->Flags & LF_READ_ONLY) && !moved) \
+		{ \
+			if ((w = MoveStringToArena(l, str, end, w)) == NULL) \
+			{ \
+				l->ErrorSink(l, (size_t)(str - l->Buffer), "Out of memory."); \
+				return NULL; \
+			} \
+ \
+			moved = true; \
+		} \
+	} while (false)
+
+	while (str < end)
 	{
+		if (!inEscape && leadBytesLeft == 0)
+		{
+			//	Runs of characters which need no attention are skipped in bulk.
+			//	Until the first escape sequence, the text is already where it
+			//	belongs; after one, it is moved down over the gap.
+			char * next = (char *)FmlSkipStringText(str, end);
+
+			if (next != str)
+			{
+				size_t const n = (size_t)(next - str);
+
+				if (w != str)
+					memmove(w, str, n);
+
+				w += n;
+				str = next;
+				continue;
+			}
+		}
+
 		char c = *str;
 
 		if (inEscape)
 		{
 			switch ((unsigned char)c)
 			{
-			case 'a': *w++ = '\a'; break;
-			case 'b': *w++ = '\b'; break;
-			case 'f': *w++ = '\f'; break;
-			case 'n': *w++ = '\n'; break;
-			case 'r': *w++ = '\r'; break;
-			case 't': *w++ = '\t'; break;
-			case 'v': *w++ = '\v'; break;
-			case '0': *w++ = '\0'; break;
-
 				//	UTF-8 multi-byte sequences are non-sensical here...
 			case 128 ... 255:
 				l->ErrorSink(l, (size_t)(str - l->Buffer), "Unexpected UTF-8 multi-byte sequence byte after backslash in string.");
 				return NULL;
 
 			default:
-				*w++ = c;
+				*w++ = FmlUnescapeChar(c);
 				break;
 			}
 
@@ -511,7 +728,7 @@ static char * LexString(LexerState * l, char * str, size_t len)
 				//	All the valid leading bytes.
 			case 128 ... 191:
 				--leadBytesLeft;
-				++str;
+				KEEP_CHAR();
 				break;
 
 			default:
@@ -522,6 +739,7 @@ static char * LexString(LexerState * l, char * str, size_t len)
 			switch ((unsigned char)c)
 			{
 			case '\\':
+				DROP_CHAR();
 				inEscape = true;
 				break;
 
@@ -532,7 +750,9 @@ static char * LexString(LexerState * l, char * str, size_t len)
 					return NULL;
 				}
 
-				*w = '\0';
+				if (!(l->Flags & LF_READ_ONLY) || moved)
+					*w = '\0';
+
 				l->workingToken->sLength = w - l->workingToken->sValue;
 				return str;
 
@@ -540,28 +760,22 @@ static char * LexString(LexerState * l, char * str, size_t len)
 			case '\t': case '\v': case '\0':
 				if (l->ErrorSink(l, (size_t)(str - l->Buffer), "Unescaped special character encountered in string."))
 					return NULL;
-				else
-					break;
+
+				DROP_CHAR();
+				break;
 
 			case 128 ... 191:
 				if (l->ErrorSink(l, (size_t)(str - l->Buffer), "Unexpected UTF-8 leading byte."))
 					return NULL;
-				else
-					break;
-
-			case 192 ... 223:
-				leadBytesLeft = 1;
-				*w++ = c;
-				break;
 
-			case 224 ... 239:
-				leadBytesLeft = 2;
-				*w++ = c;
+				DROP_CHAR();
 				break;
 
-			case 240 ... 247:
-				leadBytesLeft = 3;
-				*w++ = c;
+			case 192 ... 247:
+				//	Complete sequences were skipped above; this one is broken, and
+				//	is walked through byte by byte to report the error.
+				leadBytesLeft = (unsigned char)c >= 240 ? 3 : (unsigned char)c >= 224 ? 2 : 1;
+				KEEP_CHAR();
 				break;
 
 			case 248 ... 255:
@@ -569,13 +783,19 @@ static char * LexString(LexerState * l, char * str, size_t len)
 				return NULL;
 
 			default:
-				*w++ = c;
+				KEEP_CHAR();
 				break;
 			}
 
 		++str;
 	}
 
+#undef KEEP_CHAR
+#undef DROP_CHAR
+
+	if (l->partial)
+		return NeedMoreInput(l);
+
 	//	Reaching this point means the end of the input was reached before
 	//	the proper end of a string. Sad.
 	l->ErrorSink(l, l->InputSize, "Unterminated string.");
@@ -609,19 +829,26 @@ static char * LexDocument(LexerState * l, char * str, size_t len)
 		}
 	}
 
+	if (l->partial)
+		return NeedMoreInput(l);
+
 	//	Reaching this point means the end of the input was reached before
 	//	the proper document opening sequence was finished.
 	l->ErrorSink(l, l->InputSize, "Unterminated document opening sequence.");
 	return NULL;
 
 post_opening_sequence:
+	//	The body can't be shorter than the closing sequence anyway.
+	if (l->partial && len < 2)
+		return NeedMoreInput(l);
+
 	//	If a newline is found after the opening sequence, it's discarded.
-	if (*str == '\n')
+	if (len > 0 && *str == '\n')
 	{
 		++str;
 		--len;
 	}
-	else if (*str == '\r' && len > 1 && str[1] == '\n')
+	else if (len > 1 && *str == '\r' && str[1] == '\n')
 	{
 		str += 2;
 		len -= 2;
@@ -629,28 +856,34 @@ post_opening_sequence:
 
 	l->workingToken->sValue = str;
 
-	while (len-- > 0)
+	char const * const end = str + len;
+
+	//	Only closing brackets can end the body, so the scan jumps between them.
+	for (char const * s = str; (s = FmlFindByte(s, end, ']')) < end; ++s)
 	{
-		char c = *str++;
+		//	The closing sequence is this bracket preceded by exactly as many
+		//	equal signs as the opening one had, preceded by another bracket.
+		if (s - str < startEquals + 1 || s[-1 - startEquals] != ']')
+			continue;
 
-		switch (c)
-		{
-			//	Do nothing.
-		case '=': break;
+		int i = 0;
 
-		case ']':
-			if (closeSequenceStart != NULL && str - closeSequenceStart - 2 == startEquals)
-				goto post_closing_sequence;
-			else
-				closeSequenceStart = str - 1;
-			break;
+		while (i < startEquals && s[-1 - i] == '=')
+			++i;
 
-		default:
-			closeSequenceStart = NULL;
-			break;
-		}
+		if (i < startEquals)
+			continue;
+
+		closeSequenceStart = (char *)(s - 1 - startEquals);
+		str = (char *)(s + 1);
+		goto post_closing_sequence;
 	}
 
+	if (l->partial)
+		return NeedMoreInput(l);
+
+	str += len;
+
 	//	Reaching this point means the end of the input was reached before
 	//	the proper document opening sequence was finished.
 	l->ErrorSink(l, l->InputSize, "Unterminated document body.");
@@ -658,23 +891,17 @@ post_opening_sequence:
 
 post_closing_sequence:
 	//	If a newline is found before the closing sequence, it's discarded.
-	if (*(closeSequenceStart - 1) == '\n')
+	if (closeSequenceStart > l->workingToken->sValue && closeSequenceStart[-1] == '\n')
 	{
-		if (*(closeSequenceStart - 2) == '\r')
-		{
-			str += 2;
-			len -= 2;
-			closeSequenceStart += 2;
-		}
-		else
-		{
-			++str;
-			--len;
+		--closeSequenceStart;
+
+		if (closeSequenceStart > l->workingToken->sValue && closeSequenceStart[-1] == '\r')
 			--closeSequenceStart;
-		}
 	}
 
-	*closeSequenceStart = '\0';
+	if (!(l->Flags & LF_READ_ONLY))
+		*closeSequenceStart = '\0';
+
 	l->workingToken->sLength = closeSequenceStart - l->workingToken->sValue;
 	return str - 1;
 }
@@ -700,242 +927,1211 @@ static char * LexComment(LexerState * l, char * str, size_t len)
 		}
 	}
 
+	if (l->partial)
+		return NeedMoreInput(l);
+
 	//	This point is reached when the length is 0.
 	l->ErrorSink(l, l->InputSize - 1, "Unexpected character.");
 	return str;
 
+	char const * end;
+
 lex_line_comment:
-	while (len-- > 0)
-		if (*str++ == '\n')
-			return str - 1;
+	end = FmlFindByte(str, str + len, '\n');
+
+	if (end == str + len && l->partial)
+		return NeedMoreInput(l);
 
 	//	End of input is a valid ending for this comment.
-	return str;
+	return (char *)end;
 
 lex_block_comment:
-	(void)l;
-	bool foundAsterisk = false;
-
-	while (len-- > 0)
-	{
-		char c = *str++;
-
-		switch (c)
-		{
-		case '*':
-			foundAsterisk = true;
-			break;
+	end = str + len;
 
-		case '/':
-			if (foundAsterisk)
-				return str - 1;
-			else
-				break;
+	//	The comment ends at the first slash preceded by an asterisk, but the
+	//	asterisk of the opening sequence doesn't count.
+	for (char const * s = str; (s = FmlFindByte(s, end, '/')) < end; ++s)
+		if (s > str && s[-1] == '*')
+			return (char *)s;
 
-		default:
-			foundAsterisk = false;
-			break;
-		}
-	}
+	if (l->partial)
+		return NeedMoreInput(l);
 
 	l->ErrorSink(l, l->InputSize, "Unterminated block comment.");
-	return str;
+	return str + len;
 }
 
-LexerState * Lex(char * str, size_t const len, LexerErrorSink ers)
+enum LEX_STEP_RESULT
 {
-	LexerState * l = calloc(1, sizeof(LexerState));
-	l->Input = str;
-	l->InputSize = len;
-	l->Buffer = str = malloc(len + 1);
-	l->ErrorSink = ers;
+	LSR_NOTHING,	//	Whitespace, a comment or a bad character was skipped.
+	LSR_TOKEN,		//	A token was lexed.
+	LSR_END,		//	The end of the input was reached.
+	LSR_STOP,		//	Lexing must stop.
+	LSR_NEED_MORE,	//	Partial input ends within whatever starts at the position.
+};
+
+//	Lexes whatever starts at the given position in the input, and moves the
+//	position past it, unless more input is needed.
+//	Token offsets are relative to the start of the input.
+static enum LEX_STEP_RESULT LexStep(LexerState * l, size_t * pos, Token * tk)
+{
+	char * const str = (char *)(l->Buffer);
+	size_t const len = l->InputSize;
+	bool const readOnly = (l->Flags & LF_READ_ONLY) != 0;
+	enum LEX_STEP_RESULT res = LSR_NOTHING;
+	char * r = str + *pos;
 
-	memcpy(str, l->Input, len + 1);
+	if (r >= str + len)
+		return l->partial ? LSR_NEED_MORE : LSR_END;
 
-	char * r = str - 1;
-	Token * tk = l->workingToken = malloc(sizeof(Token));
+	l->workingToken = tk;
 
-	while (r < str + len)
+	switch ((unsigned char)*r)
 	{
-		char c = *(++r);
-		// printf("Char #%zd: %c\n", (size_t)(r - str), c);
-
-		switch ((unsigned char)c)
-		{
-			//	Whitespace, tabulators, newlines, and carriage returns
-			//	are completely ignored.
-		case ' ': case '\t': case '\n': case '\r':
+		//	Whitespace, tabulators, newlines, and carriage returns
+		//	are completely ignored.
+	case ' ': case '\t': case '\n': case '\r':
+		if (!readOnly)
 			*r = '\0';	//	Turn this into a null terminator.
-			break;
 
-			//	Alphabetic letters and underscores start an identifier.
-			//	So do UTF-8 first bytes.
-		case 'a' ... 'z': case 'A' ... 'Z': case '_': case 192 ... 255:
-			tk->Type = TT_IDENTIFIER;
-			tk->Start = (size_t)(r - str);
-			tk->sValue = r;
-
-			r = LexIdentifier(l, r, len - (size_t)(r - str));
-			goto yield_token;
-
-			//	Digits and minus start a number.
-		case '0' ... '9': case '-':
-			tk->Type = TT_INTEGER;
-			tk->Start = (size_t)(r - str);
-
-			r = LexNumber(l, r, len - (size_t)(r - str));
-			goto yield_token;
-
-			//	Double-quoted string.
-		case '"':
-			tk->Type = TT_STRING;
-			tk->Start = (size_t)(r - str);
-			tk->sValue = r + 1;
+		//	Only the first one needs to terminate whatever came before it,
+		//	so the rest of the run is skipped in bulk.
+		r += FmlSkipWhitespace(r + 1, str + len) - r - 1;
+		break;
+
+		//	Alphabetic letters and underscores start an identifier.
+		//	So do UTF-8 first bytes.
+	case 'a' ... 'z': case 'A' ... 'Z': case '_': case 192 ... 255:
+		tk->Type = TT_IDENTIFIER;
+		tk->Start = (size_t)(r - str);
+		tk->sValue = r;
+
+		r = LexIdentifier(l, r, len - (size_t)(r - str));
+		goto yield_token;
+
+		//	Digits and minus start a number.
+	case '0' ... '9': case '-':
+		tk->Type = TT_INTEGER;
+		tk->Start = (size_t)(r - str);
+
+		r = LexNumber(l, r, len - (size_t)(r - str));
+		goto yield_token;
+
+		//	Double-quoted string.
+	case '"':
+		tk->Type = TT_STRING;
+		tk->Start = (size_t)(r - str);
+		tk->sValue = r + 1;
+
+		if (!readOnly)
 			*r = '\0';
 
-			r = LexString(l, r + 1, len - (size_t)(r - str));
-			goto yield_token;
+		r = LexString(l, r + 1, len - (size_t)(r + 1 - str));
+		goto yield_token;
 
-			//	Opening square brackets start documents.
-		case '[':
-			tk->Type = TT_DOCUMENT;
-			tk->Start = (size_t)(r - str);
+		//	Opening square brackets start documents.
+	case '[':
+		tk->Type = TT_DOCUMENT;
+		tk->Start = (size_t)(r - str);
+
+		if (!readOnly)
 			*r = '\0';
 
-			r = LexDocument(l, r + 1, len - (size_t)(r - str));
-			goto yield_token;
+		r = LexDocument(l, r + 1, len - (size_t)(r + 1 - str));
+		goto yield_token;
 
-			//	Start of a comment.
-		case '/':
+		//	Start of a comment.
+	case '/':
+		if (!readOnly)
 			*r = '\0';	//	This might show up right after an identifier.
 
-			r = LexComment(l, r + 1, len - (size_t)(r - str));
-			break;	//	This will not yield a token.
-
-			//	The single-character tokens.
-		case '=':
-			tk->Type = TT_EQUAL;
-			goto single_char_tokens;
-		case '.':
-			tk->Type = TT_DOT;
-			goto single_char_tokens;
-		case '#':
-			tk->Type = TT_HASH;
-			goto single_char_tokens;
-		case '{':
-			tk->Type = TT_BRACKET_OPEN;
-			goto single_char_tokens;
-		case '}':
-			tk->Type = TT_BRACKET_CLOSE;
-			goto single_char_tokens;
-		case ';':
-			tk->Type = TT_SEMICOLON;
-			goto single_char_tokens;
-		case '$':
-			tk->Type = TT_DOLLAR;
-			//	Fallthrough.
-		
-		single_char_tokens:
-			tk->Start = (size_t)(r - str);
+		r = LexComment(l, r + 1, len - (size_t)(r + 1 - str));
+
+		if (!r)
+			goto no_token;
+
+		break;	//	This will not yield a token.
+
+		//	The single-character tokens.
+	case '=':
+		tk->Type = TT_EQUAL;
+		goto single_char_tokens;
+	case '.':
+		tk->Type = TT_DOT;
+		goto single_char_tokens;
+	case '#':
+		tk->Type = TT_HASH;
+		goto single_char_tokens;
+	case '{':
+		tk->Type = TT_BRACKET_OPEN;
+		goto single_char_tokens;
+	case '}':
+		tk->Type = TT_BRACKET_CLOSE;
+		goto single_char_tokens;
+	case ';':
+		tk->Type = TT_SEMICOLON;
+		goto single_char_tokens;
+	case '$':
+		tk->Type = TT_DOLLAR;
+		//	Fallthrough.
+
+	single_char_tokens:
+		tk->Start = (size_t)(r - str);
+
+		if (!readOnly)
 			*r = '\0';
-			goto yield_token;
+		goto yield_token;
 
-		yield_token:
-			//	Null means lexing must stop.
-			if (!r)
-				return l;
+	yield_token:
+		//	Null means lexing must stop, or wait for more input.
+		if (!r)
+			goto no_token;
 
-			tk->End = (size_t)(r - str);
-			AppendToken(l, tk);
-			l->workingToken = tk = malloc(sizeof(Token));
+		tk->End = (size_t)(r - str);
+		res = LSR_TOKEN;
+		break;
+
+		//	These are UTF-8 leading bytes in a multi-byte sequence.
+	case 128 ... 191:
+		if (l->ErrorSink(l, (size_t)(r - str), "Unexpected UTF-8 leading byte."))
+			return LSR_STOP;
+		else
 			break;
 
-			//	These are UTF-8 leading bytes in a multi-byte sequence.
-		case 128 ... 191:
-			if (l->ErrorSink(l, (size_t)(r - str), "Unexpected UTF-8 leading byte."))
-				return l;
-			else
-				break;
+		//	Other characters don't start valid tokens.
+	default:
+		if (l->ErrorSink(l, (size_t)(r - str), "Unexpected character."))
+			return LSR_STOP;
+		else
+			break;
+	}
 
-		case '\0':
-			//	A null terminator is only allowed at the end of the input.
-			if (r == str + len)
-				goto finish_lexing;
-			//	else, fall through
+	*pos = (size_t)(r + 1 - str);
+	return res;
 
-			//	Other characters don't start valid tokens.
-		default:
-			if (l->ErrorSink(l, (size_t)(r - str), "Unexpected character."))
-				return l;
-			else
-				break;
-		}
+no_token:
+	if (l->needsMore)
+	{
+		l->needsMore = false;
+		return LSR_NEED_MORE;
 	}
 
-finish_lexing:
-	tk->Type = TT_EOF;
-	tk->Start = tk->End = len;
-	AppendToken(l, tk);
-
-	return l;
+	return LSR_STOP;
 }
 
-void FreeLexerState(LexerState * l)
+//	Parallel lexing splits the input into chunks, one per thread, each
+//	starting after a newline. A chunk is lexed as if lexing started there,
+//	which is only a guess: the newline might be inside a string, comment or
+//	document. So the chunks are stitched together in order afterwards: once
+//	lexing gets to a position where a step of the next chunk started, the
+//	rest of that chunk is exactly what lexing would've found from there on.
+//	Otherwise, lexing carries on over the start of the chunk on this thread
+//	until it gets in step with it, or goes past it.
+//	Chunks are lexed as read-only, as they may overlap; errors are kept
+//	for later and only reported if the chunk gets used.
+
+#ifndef FML_LEX_MIN_CHUNK
+#define FML_LEX_MIN_CHUNK ((size_t)1 << 20)
+#endif
+
+typedef struct ChunkError_s
 {
-	free((void *)(l->Buffer));
+	size_t Step;		//	Where the step which found it started.
+	size_t Location;
+	char const * Message;
+} ChunkError;
 
-	for (Token const * tk = l->Tokens; tk != NULL; /* nothing */)
-	{
-		Token const * tkNext = tk->Next;
-		free((void *)tk);
-		tk = tkNext;
-	}
+typedef struct ChunkLexer_s
+{
+	LexerState lexer;	//	Must come first.
 
-	free(l);
-}
+	size_t Start, End;	//	Steps starting in [Start, End) are lexed.
+	size_t Last;		//	After the last step, or at the one which stopped.
+	size_t step;		//	Start of the step being lexed.
+	bool Stopped, OutOfMemory;
 
-bool ReportLexerErrorDefault(LexerState * l, size_t loc, char const * err)
+	ChunkError * Errors;
+	size_t ErrorCount, ErrorCapacity;
+
+	size_t nextToken, nextError;	//	For stitching.
+} ChunkLexer;
+
+//	A run of tokens of some stream, which goes at a given index of the result.
+typedef struct TokenRun_s
+{
+	TokenStream const * From;
+	size_t First, Last;
+	size_t At;
+} TokenRun;
+
+//	Works out which tokens of the chunks make up the result, and lexes the
+//	steps which none of them got right, reporting errors to the actual lexer
+//	state except for those it's told to skip.
+typedef struct Stitcher_s
 {
-	long line = 1, lastnl = -1, lastwsp = -1, nextnl, i;
+	LexerState lexer;	//	Holds the tokens lexed again; must come first.
 
-	//	Find the start of the line where the error is, as well as
-	//	the line number.
-	for (i = 0; i < (long)loc; ++i)
-		if (l->Input[i] == '\n')
-		{
-			lastnl = lastwsp = i;
-			++line;
-		}
-		else if (lastwsp == i - 1)
-			switch (l->Input[i])
-			{
-			case ' ': case '\t':
-				lastwsp = i;
-			default:
-				break;
-			}
+	LexerState * Target;
 
-	//	Find the end of the line where the error is.
-	for (/* nothing */; i <= (long)l->InputSize; ++i)
-		if (l->Input[i] == '\n' || l->Input[i] == '\0')
-		{
-			nextnl = i;
-			break;
-		}
+	//	Errors reported already; the sink asked to stop on the last one.
+	size_t errorsToSkip;
 
-	fprintf(stderr, "%zd:%ld: (%2X) %s\n", line, (long)loc - lastnl, l->Input[loc], err);
+	TokenRun * Runs;
+	size_t RunCount, RunCapacity;
+	size_t TokenCount;
+} Stitcher;
 
-	if (nextnl > lastnl)
+static bool RecordChunkError(LexerState * l, size_t loc, char const * err)
+{
+	ChunkLexer * c = (ChunkLexer *)l;
+
+	if (c->ErrorCount == c->ErrorCapacity)
 	{
-		fwrite(l->Input + lastnl + 1, nextnl - lastnl - 1, 1, stderr);
-		putc('\n', stderr);
+		size_t const newCap = c->ErrorCapacity < 16 ? 16 : c->ErrorCapacity * 2;
+		ChunkError * errors = realloc(c->Errors, newCap * sizeof(ChunkError));
 
-		if (lastwsp > lastnl)
-			fwrite(l->Input + lastnl + 1, lastwsp - lastnl, 1, stderr);
+		if (errors == NULL)
+		{
+			c->OutOfMemory = true;
+			return true;
+		}
 
-		if ((long)loc > lastwsp)
-			fprintf(stderr, "%*.s^\n", (int)(loc - lastwsp - 1), "");
+		c->Errors = errors;
+		c->ErrorCapacity = newCap;
 	}
 
+	c->Errors[c->ErrorCount++] = (ChunkError){ c->step, loc, err };
+
+	//	The actual sink's answer is only known when stitching.
 	return false;
 }
+
+static bool ReportRelexedError(LexerState * l, size_t loc, char const * err)
+{
+	Stitcher * st = (Stitcher *)l;
+
+	if (st->errorsToSkip > 0)
+		return --st->errorsToSkip == 0;
+
+	return st->Target->ErrorSink(st->Target, loc, err);
+}
+
+static bool AddTokenRun(Stitcher * st, TokenStream const * from, size_t first, size_t last)
+{
+	TokenRun * r = st->RunCount > 0 ? st->Runs + st->RunCount - 1 : NULL;
+
+	if (first == last)
+		return true;
+
+	if (r != NULL && r->From == from && r->Last == first)
+		r->Last = last;
+	else
+	{
+		if (st->RunCount == st->RunCapacity)
+		{
+			size_t const newCap = st->RunCapacity < 16 ? 16 : st->RunCapacity * 2;
+			TokenRun * runs = realloc(st->Runs, newCap * sizeof(TokenRun));
+
+			if (runs == NULL)
+				return false;
+
+			st->Runs = runs;
+			st->RunCapacity = newCap;
+		}
+
+		st->Runs[st->RunCount++] = (TokenRun){ from, first, last, st->TokenCount };
+	}
+
+	st->TokenCount += last - first;
+
+	return true;
+}
+
+static void * LexChunk(void * arg)
+{
+	ChunkLexer * c = arg;
+	LexerState * l = &(c->lexer);
+	size_t pos = c->Start;
+	Token tk;
+
+	while (pos < c->End)
+	{
+		c->step = pos;
+		tk.sValue = NULL;
+		tk.sLength = 0;
+
+		enum LEX_STEP_RESULT const res = LexStep(l, &pos, &tk);
+
+		if (res == LSR_TOKEN && !c->OutOfMemory && !AppendToken(l, &tk))
+			c->OutOfMemory = true;
+
+		if (c->OutOfMemory)
+		{
+			//	The step is left to the stitching, errors and all.
+			while (c->ErrorCount > 0 && c->Errors[c->ErrorCount - 1].Step == c->step)
+				--c->ErrorCount;
+
+			c->Stopped = true;
+			break;
+		}
+
+		if (res == LSR_STOP)
+		{
+			c->Stopped = true;
+			break;
+		}
+	}
+
+	c->Last = c->Stopped ? c->step : pos;
+	l->workingToken = NULL;
+
+	return NULL;
+}
+
+//	Carries on lexing from a chunk's position onwards, by adopting what the
+//	chunk found there. Returns false if lexing stops within the chunk; `pos`
+//	is moved to where lexing must go on, and `relex` tells whether the step
+//	there must be lexed again by the stitching. Each step only depends on
+//	where it starts, so the chunk can still be picked up again after that.
+static bool AdoptChunk(Stitcher * st, ChunkLexer * c, size_t * pos, bool * relex)
+{
+	LexerState * l = st->Target;
+	TokenStream const * ts = &(c->lexer.Tokens);
+	size_t first = c->nextToken, last = ts->Count;
+
+	//	The errors are reported now, in order; the chunk was lexed as if none
+	//	of them asked to stop, so it can only be followed up to the first one
+	//	which does.
+	for (size_t i = c->nextError, stepErrors = 0; i < c->ErrorCount; ++i)
+	{
+		ChunkError const * e = c->Errors + i;
+
+		if (i > c->nextError && e->Step != e[-1].Step)
+			stepErrors = 0;
+
+		++stepErrors;
+
+		if (l->ErrorSink(l, e->Location, e->Message))
+		{
+			for (last = first; last < ts->Count && ts->Starts[last] < e->Step; ++last)
+				/* nothing */;
+
+			*pos = e->Step;
+			*relex = true;
+			st->errorsToSkip = stepErrors;
+			break;
+		}
+	}
+
+	if (!AddTokenRun(st, ts, first, last))
+	{
+		l->ErrorSink(l, *pos, "Out of memory.");
+		return false;
+	}
+
+	if (*relex)
+		return true;
+
+	*pos = c->Last;
+
+	//	A chunk which ran out of memory gets another go at its last step here.
+	*relex = c->OutOfMemory;
+	st->errorsToSkip = 0;
+
+	return !c->Stopped || c->OutOfMemory;
+}
+
+//	Tells whether lexing at `pos` is in step with the chunk, moving the
+//	chunk's cursors up to there.
+static bool InStepWithChunk(ChunkLexer * c, size_t pos)
+{
+	TokenStream const * ts = &(c->lexer.Tokens);
+
+	while (c->nextToken < ts->Count && ts->Starts[c->nextToken] < pos)
+		++c->nextToken;
+
+	while (c->nextError < c->ErrorCount && c->Errors[c->nextError].Step < pos)
+		++c->nextError;
+
+	return pos == c->Start || pos == c->Last
+		|| (c->nextToken < ts->Count && ts->Starts[c->nextToken] == pos);
+}
+
+static void StitchChunks(Stitcher * st, ChunkLexer * chunks, size_t n)
+{
+	LexerState * l = st->Target;
+	TokenStream const * relexed = &(st->lexer.Tokens);
+	size_t pos = 0, k = 0;
+	bool relex = false;
+	Token tk;
+
+	for (;;)
+	{
+		//	Chunks which lexing went past are of no use.
+		while (k < n && pos > chunks[k].Last)
+			++k;
+
+		if (k < n && !relex && InStepWithChunk(chunks + k, pos))
+		{
+			if (!AdoptChunk(st, chunks + k, &pos, &relex))
+				break;
+
+			if (!relex)
+				++k;
+
+			continue;
+		}
+
+		relex = false;
+		tk.sValue = NULL;
+		tk.sLength = 0;
+
+		enum LEX_STEP_RESULT const res = LexStep(&(st->lexer), &pos, &tk);
+
+		if (res == LSR_TOKEN && (!AppendToken(&(st->lexer), &tk)
+			|| !AddTokenRun(st, relexed, relexed->Count - 1, relexed->Count)))
+		{
+			l->ErrorSink(l, tk.Start, "Out of memory.");
+			break;
+		}
+		else if (res == LSR_STOP || res == LSR_END)
+			break;
+	}
+}
+
+//	Fills a range of the result's tokens from the runs which cover it.
+typedef struct TokenCopy_s
+{
+	LexerState * Target;
+	Stitcher const * Source;
+	size_t From, To;
+} TokenCopy;
+
+static void * CopyTokenRuns(void * arg)
+{
+	TokenCopy const * tc = arg;
+	TokenStream * ts = &(tc->Target->Tokens);
+
+	for (size_t i = 0; i < tc->Source->RunCount; ++i)
+	{
+		TokenRun const * r = tc->Source->Runs + i;
+		size_t const from = r->At > tc->From ? r->At : tc->From;
+		size_t const to = r->At + (r->Last - r->First) < tc->To ? r->At + (r->Last - r->First) : tc->To;
+
+		if (from >= to)
+			continue;
+
+		size_t const src = r->First + (from - r->At), cnt = to - from;
+
+		memcpy(ts->Types + from, r->From->Types + src, cnt * sizeof(uint8_t));
+		memcpy(ts->Starts + from, r->From->Starts + src, cnt * sizeof(uint32_t));
+		memcpy(ts->Ends + from, r->From->Ends + src, cnt * sizeof(uint32_t));
+		memcpy(ts->Values + from, r->From->Values + src, cnt * sizeof(TokenValue));
+	}
+
+	//	Values must be null-terminated unless the input is read-only.
+	if (!(tc->Target->Flags & LF_READ_ONLY))
+	{
+		char const * const buf = tc->Target->Buffer, * const end = buf + tc->Target->InputSize;
+
+		for (size_t i = tc->From; i < tc->To; ++i)
+			switch (ts->Types[i])
+			{
+			case TT_IDENTIFIER: case TT_STRING: case TT_DOCUMENT:
+				//	Strings unescaped in an arena are terminated already.
+				if (ts->Values[i].sValue >= buf && ts->Values[i].sValue <= end)
+					((char *)(ts->Values[i].sValue))[ts->Values[i].sLength] = '\0';
+				break;
+
+			default:
+				break;
+			}
+	}
+
+	return NULL;
+}
+
+void FmlRunOnThreads(void * (*fn)(void *), void * args, size_t argSize, size_t n)
+{
+	pthread_t * tids = calloc(n, sizeof(pthread_t));
+	size_t started = 0;
+
+	if (tids != NULL)
+		for (/* nothing */; started + 1 < n; ++started)
+			if (pthread_create(tids + started, NULL, fn, (char *)args + (started + 1) * argSize) != 0)
+				break;
+
+	fn(args);
+
+	for (size_t k = 1; k < n; ++k)
+		if (k <= started)
+			pthread_join(tids[k - 1], NULL);
+		else
+			fn((char *)args + k * argSize);
+
+	free(tids);
+}
+
+static void ReleaseTokenStream(FmlArena * a, TokenStream const * ts)
+{
+	FmlArenaRelease(a, ts->Types, ts->Capacity * sizeof(uint8_t));
+	FmlArenaRelease(a, ts->Starts, ts->Capacity * sizeof(uint32_t));
+	FmlArenaRelease(a, ts->Ends, ts->Capacity * sizeof(uint32_t));
+	FmlArenaRelease(a, ts->Values, ts->Capacity * sizeof(TokenValue));
+}
+
+//	Lexes the whole input on several threads, if it's large enough to be
+//	worth it.
+static void LexInParallel(LexerState * l, unsigned threads)
+{
+	size_t const len = l->InputSize;
+	size_t n = len / FML_LEX_MIN_CHUNK;
+
+	if (n > threads)
+		n = threads;
+
+	if (n < 2)
+		return;
+
+	ChunkLexer * chunks = calloc(n, sizeof(ChunkLexer));
+	TokenCopy * copies = calloc(n, sizeof(TokenCopy));
+
+	Stitcher st = {
+		.lexer = {
+			.Input = l->Input, .InputSize = len, .Buffer = l->Buffer,
+			.ErrorSink = &ReportRelexedError, .Flags = l->Flags | LF_READ_ONLY,
+			.Arena = l->Arena,
+		},
+		.Target = l,
+	};
+
+	if (chunks == NULL || copies == NULL)
+		goto cleanup;
+
+	for (size_t k = 0; k < n; ++k)
+	{
+		ChunkLexer * c = chunks + k;
+
+		if (k > 0)
+		{
+			char const * const end = l->Buffer + len;
+			char const * s = FmlFindByte(l->Buffer + k * (len / n), end, '\n');
+
+			c->Start = s < end ? (size_t)(s + 1 - l->Buffer) : len;
+
+			if (c->Start < c[-1].Start)
+				c->Start = c[-1].Start;
+
+			c[-1].End = c->Start;
+		}
+
+		c->End = len;
+		c->lexer.Input = l->Input;
+		c->lexer.InputSize = len;
+		c->lexer.Buffer = l->Buffer;
+		c->lexer.ErrorSink = &RecordChunkError;
+		c->lexer.Flags = l->Flags | LF_READ_ONLY;
+		c->lexer.Arena = FmlCreateArena(0);
+		c->lexer.OwnsArena = true;
+	}
+
+	FmlRunOnThreads(&LexChunk, chunks, sizeof(ChunkLexer), n);
+
+	StitchChunks(&st, chunks, n);
+
+	//	The tokens are copied over on all the threads as well, with room
+	//	left for EOF.
+	while (l->Tokens.Capacity < st.TokenCount + 1)
+		if (!GrowTokenStream(l))
+		{
+			l->ErrorSink(l, 0, "Out of memory.");
+			st.TokenCount = 0;
+			break;
+		}
+
+	for (size_t k = 0; k < n; ++k)
+		copies[k] = (TokenCopy){ l, &st, st.TokenCount * k / n, st.TokenCount * (k + 1) / n };
+
+	if (st.TokenCount > 0)
+		FmlRunOnThreads(&CopyTokenRuns, copies, sizeof(TokenCopy), n);
+
+	l->Tokens.Count = st.TokenCount;
+	l->finished = true;
+
+cleanup:
+	if (chunks != NULL)
+		for (size_t k = 0; k < n; ++k)
+		{
+			ChunkLexer * c = chunks + k;
+
+			if (c->lexer.Arena == NULL)
+				continue;
+
+			//	Values may live in the chunk's arena, but its token stream
+			//	has been copied.
+			ReleaseTokenStream(c->lexer.Arena, &(c->lexer.Tokens));
+			FmlMergeArena(l->Arena, c->lexer.Arena);
+			free(c->Errors);
+		}
+
+	ReleaseTokenStream(l->Arena, &(st.lexer.Tokens));
+	free(st.Runs);
+	free(chunks);
+	free(copies);
+}
+
+LexerState * Lex(char const * str, size_t const len, LexerErrorSink ers)
+{
+	return LexEx(str, len, ers, NULL);
+}
+
+LexerState * LexEx(char const * input, size_t const len, LexerErrorSink ers, LexerOptions const * opts)
+{
+	LexerState * l = FmlCreateLexer(input, len, ers, opts);
+	Token tk;
+
+	if (opts != NULL && opts->Threads > 1 && !l->finished)
+		LexInParallel(l, opts->Threads);
+
+	while (FmlNextToken(l, &tk))
+		if (!AppendToken(l, &tk))
+		{
+			l->ErrorSink(l, tk.Start, "Out of memory.");
+			return l;
+		}
+
+	//	Every stream ends in EOF, even when lexing stopped early.
+	AppendToken(l, &tk);
+
+	return l;
+}
+
+LexerState * FmlCreateLexer(char const * input, size_t const len, LexerErrorSink ers, LexerOptions const * opts)
+{
+	LexerState * l = calloc(1, sizeof(LexerState));
+	l->Input = input;
+	l->InputSize = len;
+	l->ErrorSink = ers;
+	l->Flags = opts != NULL ? opts->Flags : LF_NONE;
+
+	if (l->Flags & LF_READ_ONLY)
+		l->Buffer = input;
+	else
+	{
+		char * str = malloc(len + 1);
+		memcpy(str, input, len);
+		str[len] = '\0';
+		l->Buffer = str;
+	}
+
+	if (opts != NULL && opts->Arena != NULL)
+		l->Arena = opts->Arena;
+	else
+	{
+		//	Sized so a chunk holds a good number of tokens, but small
+		//	inputs don't pay for a huge chunk.
+		l->Arena = FmlCreateArena(len < 4096 ? 4096 : 64 * 1024);
+		l->OwnsArena = true;
+	}
+
+	if (len > UINT32_MAX)
+	{
+		l->ErrorSink(l, 0, "Input is too large.");
+		l->finished = true;
+	}
+
+	return l;
+}
+
+bool FmlNextToken(LexerState * l, Token * tk)
+{
+	enum LEX_STEP_RESULT res = LSR_END;
+
+	//	Single-character tokens carry no value.
+	tk->sValue = NULL;
+	tk->sLength = 0;
+
+	if (!l->finished)
+	{
+		while ((res = LexStep(l, &(l->position), tk)) == LSR_NOTHING)
+			continue;
+
+		l->workingToken = NULL;
+
+		if (res == LSR_TOKEN)
+			return true;
+
+		l->finished = true;
+	}
+
+	//	A token which failed to lex may have left its value behind.
+	tk->Type = TT_EOF;
+	tk->Start = tk->End = l->InputSize;
+	tk->sValue = NULL;
+	tk->sLength = 0;
+
+	return false;
+}
+
+//	Returns how many tokens start before the offset.
+static size_t CountTokensBefore(TokenStream const * ts, size_t offset)
+{
+	size_t lo = 0, hi = ts->Count;
+
+	while (lo < hi)
+	{
+		size_t const mid = lo + (hi - lo) / 2;
+
+		if (ts->Starts[mid] < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+//	Values which are slices of the old input are moved to the same text in
+//	the new one; strings unescaped in the arena stay where they are.
+static void MoveTokenValue(TokenStream * ts, size_t i, char const * from, size_t fromSize, char const * to, size_t shift)
+{
+	switch (ts->Types[i])
+	{
+	case TT_IDENTIFIER: case TT_STRING: case TT_DOCUMENT:
+		if (ts->Values[i].sValue >= from && ts->Values[i].sValue <= from + fromSize)
+			ts->Values[i].sValue = to + ((size_t)(ts->Values[i].sValue - from) + shift);
+		break;
+
+	default:
+		break;
+	}
+}
+
+bool FmlRelex(LexerState * l, char const * str, size_t len, FmlEdit const * edit, FmlRelexed * res)
+{
+	TokenStream * ts = &(l->Tokens);
+	char const * const oldStr = l->Buffer;
+	size_t const oldSize = l->InputSize, oldCount = ts->Count;
+
+	if (!(l->Flags & LF_READ_ONLY) || oldCount == 0 || ts->Types[oldCount - 1] != TT_EOF
+		|| edit->Offset > oldSize || edit->Removed > oldSize - edit->Offset
+		|| len != oldSize - edit->Removed + edit->Inserted || len > UINT32_MAX)
+		return false;
+
+	size_t const editEnd = edit->Offset + edit->Inserted, oldEditEnd = edit->Offset + edit->Removed;
+
+	//	Lexing picks up at the last token which starts before the edit, as
+	//	a token may run into whatever follows it.
+	size_t const before = CountTokensBefore(ts, edit->Offset);
+	size_t const first = before > 0 ? before - 1 : 0;
+	size_t const restart = before > 0 ? ts->Starts[first] : 0;
+	size_t pos = restart, oldEnd;
+
+	l->Input = l->Buffer = str;
+	l->InputSize = len;
+	free(l->lineStarts);
+	l->lineStarts = NULL;
+	l->lineCount = 0;
+
+	Stitcher st = {
+		.lexer = {
+			.Input = str, .InputSize = len, .Buffer = str,
+			.ErrorSink = &ReportRelexedError, .Flags = l->Flags,
+			.Arena = l->Arena,
+		},
+		.Target = l,
+	};
+	TokenStream * relexed = &(st.lexer.Tokens);
+	Token tk;
+
+	for (oldEnd = first; /* nothing */; /* nothing */)
+	{
+		//	Past the edit, lexing is back in step when it gets to where an
+		//	old token starts; it would only go the same way as before from
+		//	there. The old EOF is where the input ends, so it's found there
+		//	at the latest (a step may overshoot the end).
+		if (pos >= editEnd)
+		{
+			size_t const oldPos = (pos < len ? pos : len) - editEnd + oldEditEnd;
+
+			while (ts->Starts[oldEnd] < oldPos)
+				++oldEnd;
+
+			if (ts->Starts[oldEnd] == oldPos)
+				break;
+		}
+
+		tk.sValue = NULL;
+		tk.sLength = 0;
+
+		enum LEX_STEP_RESULT const step = LexStep(&(st.lexer), &pos, &tk);
+
+		if (step == LSR_TOKEN && !AppendToken(&(st.lexer), &tk))
+			l->ErrorSink(l, tk.Start, "Out of memory.");
+		else if (step != LSR_STOP && step != LSR_END)
+			continue;
+
+		//	Nothing is kept after a stop but the EOF.
+		oldEnd = oldCount - 1;
+		break;
+	}
+
+	size_t count = first + relexed->Count + (oldCount - oldEnd);
+
+	while (ts->Capacity < count)
+		if (!GrowTokenStream(l))
+		{
+			l->ErrorSink(l, edit->Offset, "Out of memory.");
+			relexed->Count = 0;
+			oldEnd = oldCount - 1;
+			count = first + 1;
+		}
+
+	size_t const newEnd = first + relexed->Count, moved = oldCount - oldEnd;
+
+	memmove(ts->Types + newEnd, ts->Types + oldEnd, moved * sizeof(uint8_t));
+	memmove(ts->Starts + newEnd, ts->Starts + oldEnd, moved * sizeof(uint32_t));
+	memmove(ts->Ends + newEnd, ts->Ends + oldEnd, moved * sizeof(uint32_t));
+	memmove(ts->Values + newEnd, ts->Values + oldEnd, moved * sizeof(TokenValue));
+
+	if (relexed->Count > 0)
+	{
+		memcpy(ts->Types + first, relexed->Types, relexed->Count * sizeof(uint8_t));
+		memcpy(ts->Starts + first, relexed->Starts, relexed->Count * sizeof(uint32_t));
+		memcpy(ts->Ends + first, relexed->Ends, relexed->Count * sizeof(uint32_t));
+		memcpy(ts->Values + first, relexed->Values, relexed->Count * sizeof(TokenValue));
+	}
+
+	ts->Count = count;
+
+	//	Offsets wrap around when the input got shorter, which works out the
+	//	same in the end.
+	size_t const shift = edit->Inserted - edit->Removed;
+
+	if (str != oldStr)
+		for (size_t i = 0; i < first; ++i)
+			MoveTokenValue(ts, i, oldStr, oldSize, str, 0);
+
+	for (size_t i = newEnd; i < count && (shift != 0 || str != oldStr); ++i)
+	{
+		ts->Starts[i] += (uint32_t)shift;
+		ts->Ends[i] += (uint32_t)shift;
+		MoveTokenValue(ts, i, oldStr, oldSize, str, shift);
+	}
+
+	ReleaseTokenStream(l->Arena, relexed);
+
+	*res = (FmlRelexed){ first, oldEnd, newEnd, restart };
+
+	return true;
+}
+
+void FreeLexerState(LexerState * l)
+{
+	free(l->lineStarts);
+
+	if (l->Buffer != l->Input)
+		free((void *)(l->Buffer));
+
+	//	Tokens are not freed individually; they go away with the arena.
+	if (l->OwnsArena)
+		FmlFreeArena(l->Arena);
+
+	free(l);
+}
+
+static bool IndexLines(LexerState * l)
+{
+	char const * const end = l->Input + l->InputSize;
+	size_t cnt = 1;
+
+	for (char const * s = l->Input; (s = FmlFindByte(s, end, '\n')) < end; ++s)
+		++cnt;
+
+	size_t * starts = malloc(cnt * sizeof(size_t));
+
+	if (starts == NULL)
+		return false;
+
+	starts[0] = 0;
+	cnt = 1;
+
+	for (char const * s = l->Input; (s = FmlFindByte(s, end, '\n')) < end; ++s)
+		starts[cnt++] = (size_t)(s + 1 - l->Input);
+
+	l->lineStarts = starts;
+	l->lineCount = cnt;
+
+	return true;
+}
+
+FmlLocation FmlLocate(LexerState const * l, size_t offset)
+{
+	FmlLocation res = { .LineEnd = l->InputSize };
+
+	if (offset > l->InputSize)
+		offset = l->InputSize;
+
+	//	The index is a cache, so it's fine to build it behind a const pointer.
+	if (l->lineStarts != NULL || IndexLines((LexerState *)l))
+	{
+		//	Looks for the last line starting at or before the offset.
+		size_t lo = 0, hi = l->lineCount;
+
+		while (hi - lo > 1)
+		{
+			size_t const mid = lo + (hi - lo) / 2;
+
+			if (l->lineStarts[mid] <= offset)
+				lo = mid;
+			else
+				hi = mid;
+		}
+
+		res.Line = lo + 1;
+		res.LineStart = l->lineStarts[lo];
+
+		if (hi < l->lineCount)
+			res.LineEnd = l->lineStarts[hi] - 1;
+	}
+	else
+	{
+		//	Without memory for the index, lines are counted the slow way.
+		char const * const at = l->Input + offset;
+
+		res.Line = 1;
+
+		for (char const * s = l->Input; (s = FmlFindByte(s, at, '\n')) < at; ++s)
+		{
+			++res.Line;
+			res.LineStart = (size_t)(s + 1 - l->Input);
+		}
+
+		res.LineEnd = (size_t)(FmlFindByte(at, l->Input + l->InputSize, '\n') - l->Input);
+	}
+
+	res.Column = offset - res.LineStart + 1;
+
+	return res;
+}
+
+bool ReportLexerErrorDefault(LexerState * l, size_t loc, char const * err)
+{
+	if (loc > l->InputSize)
+		loc = l->InputSize;
+
+	FmlLocation const at = FmlLocate(l, loc);
+	long const lastnl = (long)(at.LineStart) - 1;
+	long lastwsp = lastnl, nextnl = (long)(at.LineEnd);
+
+	//	The indentation of the line is copied before the caret, so it lines up
+	//	with tabs too.
+	for (size_t i = at.LineStart; i < loc && (l->Input[i] == ' ' || l->Input[i] == '\t'); ++i)
+		lastwsp = (long)i;
+
+	//	The line is only shown up to a null character after the error.
+	char const * const nul = memchr(l->Input + loc, '\0', at.LineEnd - loc);
+
+	if (nul != NULL)
+		nextnl = nul - l->Input;
+
+	fprintf(stderr, "%zu:%zu: (%2X) %s\n", at.Line, at.Column
+		, loc < l->InputSize ? l->Input[loc] : '\0', err);
+
+	if (nextnl > lastnl)
+	{
+		fwrite(l->Input + lastnl + 1, nextnl - lastnl - 1, 1, stderr);
+		putc('\n', stderr);
+
+		if (lastwsp > lastnl)
+			fwrite(l->Input + lastnl + 1, lastwsp - lastnl, 1, stderr);
+
+		if ((long)loc > lastwsp)
+			fprintf(stderr, "%*.s^\n", (int)(loc - lastwsp - 1), "");
+	}
+
+	return false;
+}
+
+static bool ReportStreamError(LexerState * l, size_t loc, char const * err)
+{
+	FmlStreamLexer * sl = (FmlStreamLexer *)l;
+	++sl->stepErrors;
+
+	//	A token which had to wait for more input is lexed again from its start,
+	//	and the errors found in it the first time around were reported already.
+	if (sl->errorsToSkip > 0)
+	{
+		--sl->errorsToSkip;
+		return false;
+	}
+
+	return sl->ErrorSink(sl, sl->Offset + loc, err);
+}
+
+//	Hands out all the tokens which can be lexed from the given window, and
+//	sets `consumed` to the length of the part they span.
+//	Returns false if lexing must stop.
+static bool LexWindow(FmlStreamLexer * sl, char const * buf, size_t len, bool partial, size_t * consumed)
+{
+	LexerState * l = &(sl->lexer);
+	l->Input = l->Buffer = buf;
+	l->InputSize = len;
+	l->partial = partial;
+
+	Token tk = {0};
+	size_t pos = 0;
+
+	for (;;)
+	{
+		sl->stepErrors = 0;
+
+		switch (LexStep(l, &pos, &tk))
+		{
+		case LSR_NOTHING:
+			break;
+
+		case LSR_TOKEN:
+			tk.Start += sl->Offset;
+			tk.End += sl->Offset;
+
+			if (sl->TokenSink(sl, &tk))
+				sl->Stopped = true;
+
+			//	Strings with escape sequences are unescaped in here.
+			FmlResetArena(l->Arena);
+
+			if (sl->Stopped)
+				return false;
+
+			break;
+
+		case LSR_NEED_MORE:
+			sl->errorsToSkip = sl->stepErrors;
+			//	Fallthrough.
+
+		case LSR_END:
+			//	Comments running into the end move past it.
+			*consumed = pos < len ? pos : len;
+			return true;
+
+		case LSR_STOP:
+			sl->Stopped = true;
+			return false;
+		}
+	}
+}
+
+static bool AppendToWindow(FmlStreamLexer * sl, char const * data, size_t len)
+{
+	//	The window may not even exist yet.
+	if (len == 0)
+		return true;
+
+	if (len > sl->WindowCapacity - sl->WindowSize)
+	{
+		size_t cap = sl->WindowCapacity < 4096 ? 4096 : sl->WindowCapacity;
+
+		while (cap < sl->WindowSize + len)
+			cap *= 2;
+
+		char * w = realloc(sl->Window, cap);
+
+		if (w == NULL)
+		{
+			sl->ErrorSink(sl, sl->Offset + sl->WindowSize, "Out of memory.");
+			sl->Stopped = true;
+			return false;
+		}
+
+		sl->Window = w;
+		sl->WindowCapacity = cap;
+	}
+
+	memcpy(sl->Window + sl->WindowSize, data, len);
+	sl->WindowSize += len;
+
+	return true;
+}
+
+FmlStreamLexer * FmlCreateStreamLexer(FmlTokenSink tks, FmlStreamErrorSink ers, void * ctxt)
+{
+	FmlStreamLexer * sl = calloc(1, sizeof(FmlStreamLexer));
+	sl->TokenSink = tks;
+	sl->ErrorSink = ers;
+	sl->Context = ctxt;
+
+	//	The input is never written to, and the arena only ever holds the
+	//	value of the current token.
+	sl->lexer.Flags = LF_READ_ONLY;
+	sl->lexer.ErrorSink = &ReportStreamError;
+	sl->lexer.Arena = FmlCreateArena(4096);
+	sl->lexer.OwnsArena = true;
+
+	return sl;
+}
+
+void FmlFreeStreamLexer(FmlStreamLexer * sl)
+{
+	FmlFreeArena(sl->lexer.Arena);
+	free(sl->Window);
+	free(sl);
+}
+
+bool FmlFeedStreamLexer(FmlStreamLexer * sl, char const * data, size_t len)
+{
+	size_t consumed;
+	sl->InputSize += len;
+
+	if (sl->Stopped)
+		return false;
+
+	if (sl->WindowSize == 0)
+	{
+		//	Nothing is left over, so the chunk is lexed where it is, and only
+		//	its unfinished end is kept.
+		if (!LexWindow(sl, data, len, true, &consumed))
+			return false;
+
+		sl->Offset += consumed;
+		sl->retrySize = 2 * (len - consumed);
+
+		return AppendToWindow(sl, data + consumed, len - consumed);
+	}
+
+	if (!AppendToWindow(sl, data, len))
+		return false;
+
+	//	A token spanning many chunks isn't lexed again for every one of them;
+	//	waiting for the window to double keeps the total work linear.
+	if (sl->WindowSize < sl->retrySize)
+		return true;
+
+	if (!LexWindow(sl, sl->Window, sl->WindowSize, true, &consumed))
+		return false;
+
+	sl->WindowSize -= consumed;
+	sl->Offset += consumed;
+	sl->retrySize = 2 * sl->WindowSize;
+	memmove(sl->Window, sl->Window + consumed, sl->WindowSize);
+
+	return true;
+}
+
+bool FmlFinishStreamLexer(FmlStreamLexer * sl)
+{
+	size_t consumed;
+
+	if (!sl->Stopped)
+		LexWindow(sl, sl->Window, sl->WindowSize, false, &consumed);
+
+	sl->Offset += sl->WindowSize;
+	sl->WindowSize = 0;
+
+	Token tk = {0};
+	tk.Type = TT_EOF;
+	tk.Start = tk.End = sl->InputSize;
+	sl->TokenSink(sl, &tk);
+
+	return !sl->Stopped;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "arena.h"
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -12,42 +13,214 @@ enum TOKEN_TYPES
 	TT_EOF
 };
 
+#define TOKEN_VALUE \
+	union \
+	{ \
+		struct					/*	TT_IDENTIFIER, TT_STRING, TT_DOCUMENT	*/ \
+		{ \
+			char const * sValue; \
+			size_t sLength; \
+		}; \
+ \
+		long long int lValue;	/*	TT_INTEGER	*/ \
+		double dValue;			/*	TT_FLOAT	*/ \
+	};
+
 typedef struct Token_s
 {
 	enum TOKEN_TYPES Type;
 	size_t Start, End;
 
-	union
-	{
-		struct					//	TT_IDENTIFIER, TT_STRING, TT_DOCUMENT
-		{
-			char const * sValue;
-			size_t sLength;
-		};
+	TOKEN_VALUE
+} Token;
+
+typedef struct TokenValue_s
+{
+	TOKEN_VALUE
+} TokenValue;
+
+//	Tokens are stored as a structure of arrays, indexed by token number.
+//	Offsets are 32-bit, so a single input cannot exceed 4 GiB.
+//	The last token is always TT_EOF.
+typedef struct TokenStream_s
+{
+	uint8_t * Types;			//	enum TOKEN_TYPES
+	uint32_t * Starts, * Ends;
+	TokenValue * Values;
+
+	size_t Count, Capacity;
+} TokenStream;
 
-		long long int lValue;	//	TT_INTEGER
-		double dValue;			//	TT_FLOAT
+static inline Token FmlGetToken(TokenStream const * ts, size_t i)
+{
+	Token tk = {
+		.Type = (enum TOKEN_TYPES)(ts->Types[i]),
+		.Start = ts->Starts[i],
+		.End = ts->Ends[i],
 	};
 
-	struct Token_s * Next;
-} Token;
+	//	The string members span the whole value union.
+	tk.sValue = ts->Values[i].sValue;
+	tk.sLength = ts->Values[i].sLength;
+
+	return tk;
+}
 
 struct LexerState_s;
 typedef struct LexerState_s LexerState;
 
 typedef bool (*LexerErrorSink)(LexerState * l, size_t loc, char const * err);
 
+enum LEXER_FLAGS
+{
+	LF_NONE = 0,
+
+	//	The input is never written to nor copied, so it can be read-only memory
+	//	(e.g. a `PROT_READ` mapping of a file). Identifiers, strings and
+	//	documents are then slices of the input, and not null-terminated; only
+	//	strings with escape sequences are unescaped into the arena.
+	LF_READ_ONLY = 1 << 0,
+};
+
 struct LexerState_s
 {
-	Token const * Tokens;
-	Token * lastToken, * workingToken;
+	TokenStream Tokens;
+	Token * workingToken;
 	char const * Input;
 	size_t InputSize;
-	char const * Buffer;
+	char const * Buffer;	//	The input itself when it's read-only.
 	LexerErrorSink ErrorSink;
+	unsigned Flags;			//	enum LEXER_FLAGS
+
+	FmlArena * Arena;	//	The token stream lives here.
+	bool OwnsArena;
+
+	size_t position;	//	Of the next byte to lex.
+	bool finished;		//	Only EOF is left to hand out.
+
+	size_t * lineStarts;	//	Built by `FmlLocate` when first needed.
+	size_t lineCount;
+
+	bool partial;		//	More input may follow the end of this one.
+	bool needsMore;
 };
 
-LexerState * Lex(char * str, size_t const len, LexerErrorSink ers);
+typedef struct LexerOptions_s
+{
+	//	When given, the token stream is allocated from this arena and it is left
+	//	alone by `FreeLexerState`; the caller may reset and reuse it after.
+	FmlArena * Arena;
+
+	unsigned Flags;			//	enum LEXER_FLAGS
+
+	//	Large inputs are split into chunks which are lexed on this many threads
+	//	(by `LexEx` only); 0 and 1 mean only the calling thread is used.
+	//	The tokens and errors are the same either way.
+	unsigned Threads;
+} LexerOptions;
+
+//	Without `LF_READ_ONLY`, the input is copied, and the values of
+//	identifiers, strings and documents are null-terminated within the copy.
+//	Either way, their `sLength` is what counts.
+LexerState * Lex(char const * str, size_t const len, LexerErrorSink ers);
+LexerState * LexEx(char const * str, size_t const len, LexerErrorSink ers, LexerOptions const * opts);
 void FreeLexerState(LexerState * l);
 
+//	Sets up a lexer which builds no token stream; instead, tokens are pulled
+//	out of it one at a time with `FmlNextToken`. Values are the same as with
+//	`LexEx` and live as long as the lexer does.
+LexerState * FmlCreateLexer(char const * str, size_t const len, LexerErrorSink ers, LexerOptions const * opts);
+
+//	Lexes the next token. Returns false when that is the final EOF, which is
+//	handed out again on every call after.
+bool FmlNextToken(LexerState * l, Token * tk);
+
+//	An edit of the input: `Removed` bytes at `Offset` were replaced by
+//	`Inserted` bytes, which are at the same offset in the new input.
+typedef struct FmlEdit_s
+{
+	size_t Offset, Removed, Inserted;
+} FmlEdit;
+
+//	Which tokens `FmlRelex` replaced: those in [First, OldEnd) of the old
+//	stream are now those in [First, NewEnd). The ones after moved with the
+//	text that follows the edit.
+typedef struct FmlRelexed_s
+{
+	size_t First, OldEnd, NewEnd;
+	size_t Offset;	//	Where lexing picked up, in both inputs.
+} FmlRelexed;
+
+//	Brings the token stream of a read-only lexer in line with the edited
+//	input, which takes the place of the old one and must outlive the lexer
+//	just the same. Only the tokens around the edit are lexed again, until
+//	lexing is back in step with the old tokens; the rest are kept, and the
+//	values which were slices of the old input are moved over to the new one.
+//	Errors are only reported for what's lexed again, and if lexing stops
+//	there, the tokens after are dropped.
+//	Returns false, leaving the lexer as it was, if the lexer has no token
+//	stream (or isn't read-only) or the edit doesn't fit the inputs.
+bool FmlRelex(LexerState * l, char const * str, size_t len, FmlEdit const * edit, FmlRelexed * res);
+
 bool ReportLexerErrorDefault(LexerState * l, size_t loc, char const * err);
+
+//	Where an offset into the input is. Lines and columns count from 1, and
+//	columns are in bytes.
+typedef struct FmlLocation_s
+{
+	size_t Line, Column;
+	size_t LineStart;	//	Offset of the first byte of the line.
+	size_t LineEnd;		//	Offset of its newline, or the end of the input.
+} FmlLocation;
+
+//	The first call indexes the lines of the input, so later ones only take
+//	a binary search. Offsets past the end of the input are taken as the end.
+FmlLocation FmlLocate(LexerState const * l, size_t offset);
+
+//	A lexer which is fed the input a chunk at a time (e.g. from a `read` loop)
+//	and hands out tokens as soon as they are complete. Only the unfinished
+//	token at the end of a chunk is kept around until the next one, so memory
+//	use is bounded by the largest token rather than by the size of the input.
+//	Token and error offsets are from the start of the whole input. The values
+//	of identifiers, strings and documents only live until the token sink
+//	returns, and aren't null-terminated.
+typedef struct FmlStreamLexer_s FmlStreamLexer;
+
+//	Both sinks return true to stop lexing.
+typedef bool (*FmlTokenSink)(FmlStreamLexer * sl, Token const * tk);
+typedef bool (*FmlStreamErrorSink)(FmlStreamLexer * sl, size_t loc, char const * err);
+
+struct FmlStreamLexer_s
+{
+	LexerState lexer;	//	Works on the current window; must come first.
+
+	//	Holds what's left of the previous chunks: the start of a token which
+	//	ran into the end of the input so far.
+	char * Window;
+	size_t WindowSize, WindowCapacity;
+	size_t Offset;		//	Of the start of the window within the whole input.
+	size_t InputSize;	//	Fed so far.
+	size_t retrySize;	//	Window size at which lexing it is attempted again.
+
+	FmlTokenSink TokenSink;
+	FmlStreamErrorSink ErrorSink;
+	void * Context;		//	For the sinks to use.
+
+	size_t stepErrors, errorsToSkip;
+	bool Stopped;
+};
+
+FmlStreamLexer * FmlCreateStreamLexer(FmlTokenSink tks, FmlStreamErrorSink ers, void * ctxt);
+void FmlFreeStreamLexer(FmlStreamLexer * sl);
+
+//	These return false once lexing has stopped.
+bool FmlFeedStreamLexer(FmlStreamLexer * sl, char const * data, size_t len);
+
+//	Lexes what's left as the end of the input, and hands out the final EOF
+//	token (even if lexing stopped early).
+bool FmlFinishStreamLexer(FmlStreamLexer * sl);
+
+//	Runs `fn` on each of the `n` arguments, which are `argSize` bytes apart, on
+//	as many threads. If a thread can't be started, its work is done on the
+//	calling one.
+void FmlRunOnThreads(void * (*fn)(void *), void * args, size_t argSize, size_t n);
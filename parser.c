@@ -1,111 +1,205 @@
 #include "parser.h"
+#include "index.h"
 #include <stdio.h>
+#include <string.h>
 
-static Token const * ConsumeToken(ParserState * const p)
+//	Tokens are referred to by their index in the lexer's token stream, but
+//	they are read through a small window, which is how they can also be pulled
+//	straight from the lexer without ever storing all of them.
+//	The parser never moves past the final EOF token.
+static inline Token const * Tk(ParserState const * p, size_t tk)
 {
-	if (p->curToken == NULL)
-		return p->curToken = p->lexer->Tokens;
+	return p->window + (tk & (FML_PARSER_LOOKAHEAD - 1));
+}
+
+static size_t PeekToken(ParserState * const p)
+{
+	size_t const tk = p->tokenIndex;
+
+	if (tk == p->tokensRead)
+	{
+		Token * const slot = p->window + (tk & (FML_PARSER_LOOKAHEAD - 1));
+
+		if (p->source != NULL)
+			(void)FmlNextToken(p->source, slot);
+		else if (tk < p->tokenLimit)
+			*slot = FmlGetToken(&(p->lexer->Tokens), tk);
+		else
+			*slot = (Token){ .Type = TT_EOF, .Start = p->lexer->Tokens.Starts[tk], .End = p->lexer->Tokens.Starts[tk] };
 
-	Token const * const next = p->curToken->Next;
-	return p->curToken = next;
+		++p->tokensRead;
+	}
+
+	return tk;
 }
 
-static Token const * PeekToken(ParserState * const p)
+static size_t ConsumeToken(ParserState * const p)
 {
-	if (p->curToken == NULL)
-		return p->lexer->Tokens;
-	else
-		return p->curToken->Next;
+	size_t const tk = PeekToken(p);
+
+	if (Tk(p, tk)->Type != TT_EOF)
+		++p->tokenIndex;
+
+	return tk;
+}
+
+static inline enum TOKEN_TYPES TkType(ParserState const * p, size_t tk)
+{
+	return Tk(p, tk)->Type;
 }
 
-static bool ReportTkError(ParserState * p, Token const * tk, char const * err)
+static inline size_t TkStart(ParserState const * p, size_t tk)
 {
-	return p->ErrorSink(p, tk->Start, tk->End - tk->Start, err);
+	return Tk(p, tk)->Start;
 }
 
-static Node * ParseNode(ParserState * p)
+static inline size_t TkEnd(ParserState const * p, size_t tk)
 {
-	Token const * tk = ConsumeToken(p);
+	return Tk(p, tk)->End;
+}
+
+static inline Token const * TkValue(ParserState const * p, size_t tk)
+{
+	return Tk(p, tk);
+}
+
+static inline FmlSymbol InternName(ParserState * p, char const * str, size_t len)
+{
+	return p->Symbols != NULL ? FmlIntern(p->Symbols, str, len) : 0;
+}
+
+//	Expressions are zeroed, like they'd come from `calloc`.
+static void * NewExpression(ParserState * p, size_t size)
+{
+	void * res = FmlArenaAlloc(p->Arena, size);
+
+	if (res != NULL)
+		memset(res, 0, size);
+
+	return res;
+}
+
+static bool ReportTkError(ParserState * p, size_t tk, char const * err)
+{
+	return p->ErrorSink(p, TkStart(p, tk), TkEnd(p, tk) - TkStart(p, tk), err);
+}
+
+//	Parses a node up to its body. When the body holds children, the opening
+//	bracket is consumed and true is returned; the children are up to the
+//	caller.
+static bool ParseNodeHead(ParserState * p, Node * * res)
+{
+	size_t tk = ConsumeToken(p);
 	//	This one is guaranteed to be an identifier.
 
-	Node * ne = calloc(1, sizeof(Node));
+	Node * ne = *res = NewExpression(p, sizeof(Node));
 	ne->Type = ET_NODE;
-	ne->Start = tk->Start;
-	ne->Name = tk->sValue;
+	ne->Start = TkStart(p, tk);
+	ne->Name = TkValue(p, tk)->sValue;
+	ne->NameLength = TkValue(p, tk)->sLength;
+	ne->NameSymbol = InternName(p, ne->Name, ne->NameLength);
 
 	// printf("Node named %s.\n", ne->Name);
 
 	Class * * cl = &(ne->Classes);
 
 	//	If the token consumed here isn't a dot, it's used by the code after.
-	while ((tk = ConsumeToken(p))->Type == TT_DOT)
+	while (TkType(p, tk = ConsumeToken(p)) == TT_DOT)
 	{
-		size_t start = tk->Start;
+		size_t start = TkStart(p, tk);
 
 		//	Dot requires an identifier (class name) after it.
 		tk = ConsumeToken(p);
 
-		if (tk->Type != TT_IDENTIFIER)
+		if (TkType(p, tk) != TT_IDENTIFIER)
 		{
-			ne->End = tk->End;
+			ne->End = TkEnd(p, tk);
 
 			if (ReportTkError(p, tk, "Expected identifier after dot.")
-				|| tk->Type == TT_EOF)
-				return ne;
+				|| TkType(p, tk) == TT_EOF)
+				return false;
 			else
 				continue;
 		}
 
-		*cl = calloc(1, sizeof(Class));
+		*cl = NewExpression(p, sizeof(Class));
 		(*cl)->Type = ET_CLASS;
 		(*cl)->Start = start;
-		(*cl)->End = tk->End;
-		(*cl)->Name = tk->sValue;
+		(*cl)->End = TkEnd(p, tk);
+		(*cl)->Name = TkValue(p, tk)->sValue;
+		(*cl)->NameLength = TkValue(p, tk)->sLength;
+		(*cl)->NameSymbol = InternName(p, (*cl)->Name, (*cl)->NameLength);
+
+		if (p->Classes != NULL && !FmlAddClass(p->Classes, (*cl)->NameSymbol, ne))
+		{
+			FmlFreeClassIndex(p->Classes);
+			p->Classes = NULL;
+		}
 
 		cl = &((*cl)->Next);
 
-		// printf("\tClass named %s.\n", tk->sValue);
+		// printf("\tClass named %s.\n", TkValue(p, tk)->sValue);
 	}
 
-	if (tk->Type == TT_HASH)
+	if (TkType(p, tk) == TT_HASH)
 	{
 		//	Hash requires an identifier (ID) after it.
 		tk = ConsumeToken(p);
 
-		if (tk->Type != TT_IDENTIFIER)
+		if (TkType(p, tk) != TT_IDENTIFIER)
 		{
-			ne->End = tk->End;
+			ne->End = TkEnd(p, tk);
 
 			if (ReportTkError(p, tk, "Expected identifier after hash.")
-				|| tk->Type == TT_EOF)
-				return ne;
+				|| TkType(p, tk) == TT_EOF)
+				return false;
 		}
 		else
-			ne->Id = tk->sValue;
+		{
+			ne->Id = TkValue(p, tk)->sValue;
+			ne->IdLength = TkValue(p, tk)->sLength;
 
-		// printf("\tID named %s.\n", tk->sValue);
+			if (p->Ids != NULL)
+			{
+				Node const * const first = FmlAddId(p->Ids, ne);
+
+				if (first == NULL)
+				{
+					//	It'll be built from the tree if it's ever needed.
+					FmlFreeIdIndex(p->Ids);
+					p->Ids = NULL;
+				}
+				else if (first != ne)
+					ReportTkError(p, tk, "Duplicate ID.");
+			}
+		}
+
+		// printf("\tID named %s.\n", TkValue(p, tk)->sValue);
 
 		tk = ConsumeToken(p);	//	Moves on to the next token.
 	}
 
 	Attribute * * at = &(ne->Attributes);
 
-	for (/* nothing */; tk->Type == TT_IDENTIFIER; tk = ConsumeToken(p))
+	for (/* nothing */; TkType(p, tk) == TT_IDENTIFIER; tk = ConsumeToken(p))
 	{
-		Attribute * ae = *at = calloc(1, sizeof(Attribute));
+		Attribute * ae = *at = NewExpression(p, sizeof(Attribute));
 		ae->Type = ET_ATTRIBUTE;
-		ae->Start = tk->Start;
-		ae->End = tk->End;
-		ae->Key = tk->sValue;
+		ae->Start = TkStart(p, tk);
+		ae->End = TkEnd(p, tk);
+		ae->Key = TkValue(p, tk)->sValue;
+		ae->KeyLength = TkValue(p, tk)->sLength;
+		ae->KeySymbol = InternName(p, ae->Key, ae->KeyLength);
 		at = &(ae->Next);
 
-		// printf("\tAttribute named %s.\n", tk->sValue);
+		// printf("\tAttribute named %s.\n", TkValue(p, tk)->sValue);
 
-		tk = ConsumeToken(p);
+		tk = PeekToken(p);
 
-		switch (tk->Type)
+		switch (TkType(p, tk))
 		{
 			//	All these mean that this attribute has a null value.
+			//	The token is left to be consumed by the loop.
 		case TT_IDENTIFIER:		//	Next is another attribute.
 		case TT_SEMICOLON:		//	Node ends.
 		case TT_BRACKET_OPEN:	//	Node children begin.
@@ -116,34 +210,35 @@ static Node * ParseNode(ParserState * p)
 
 			//	This means the attribute has an explicit value.
 		case TT_EQUAL:
+			(void)ConsumeToken(p);
 			tk = ConsumeToken(p);
 
-			switch (tk->Type)
+			switch (TkType(p, tk))
 			{
 			case TT_INTEGER:
 				ae->ValueType = AVT_INTEGER;
-				ae->lValue = tk->lValue;
-				// printf("\t\tInteger value %llu.\n", tk->lValue);
+				ae->lValue = TkValue(p, tk)->lValue;
+				// printf("\t\tInteger value %llu.\n", TkValue(p, tk)->lValue);
 				break;
 
 			case TT_FLOAT:
 				ae->ValueType = AVT_FLOAT;
-				ae->dValue = tk->dValue;
-				// printf("\t\tFloat value %f.\n", tk->dValue);
+				ae->dValue = TkValue(p, tk)->dValue;
+				// printf("\t\tFloat value %f.\n", TkValue(p, tk)->dValue);
 				break;
 
 			case TT_STRING:
 				ae->ValueType = AVT_STRING;
-				ae->sValue = tk->sValue;
-				ae->sLength = tk->sLength;
-				// printf("\t\tString value %s.\n", tk->sValue);
+				ae->sValue = TkValue(p, tk)->sValue;
+				ae->sLength = TkValue(p, tk)->sLength;
+				// printf("\t\tString value %s.\n", TkValue(p, tk)->sValue);
 				break;
 
 			case TT_IDENTIFIER:
 				ae->ValueType = AVT_IDENTIFIER;
-				ae->sValue = tk->sValue;
-				ae->sLength = tk->sLength;
-				// printf("\t\tIdentifier value %s.\n", tk->sValue);
+				ae->sValue = TkValue(p, tk)->sValue;
+				ae->sLength = TkValue(p, tk)->sLength;
+				// printf("\t\tIdentifier value %s.\n", TkValue(p, tk)->sValue);
 				break;
 
 			case TT_DOLLAR:
@@ -151,243 +246,979 @@ static Node * ParseNode(ParserState * p)
 
 				tk = ConsumeToken(p);
 
-				if (tk->Type != TT_IDENTIFIER)
+				if (TkType(p, tk) != TT_IDENTIFIER)
 				{
-					ne->End = tk->End;
+					ne->End = TkEnd(p, tk);
 
 					if (ReportTkError(p, tk, "Expected identifier after dollar sign."))
-						return ne;
+						return false;
 					else
 						continue;
 				}
 
-				ae->sValue = tk->sValue;
-				ae->sLength = tk->sLength;
-				// printf("\t\tReference value %s.\n", tk->sValue);
+				ae->sValue = TkValue(p, tk)->sValue;
+				ae->sLength = TkValue(p, tk)->sLength;
+				// printf("\t\tReference value %s.\n", TkValue(p, tk)->sValue);
 				break;
 
 			case TT_EOF:
-				ne->End = tk->End;
+				ne->End = TkEnd(p, tk);
 
 				ReportTkError(p, tk, "Unfinished attribute.");
-				return ne;
+				return false;
 
 			default:
-				ne->End = tk->End;
+				ne->End = TkEnd(p, tk);
 
 				if (ReportTkError(p, tk, "Unexpected token after equal sign."))
-					return ne;
+					return false;
 				else
 					continue;
 			}
 
-			ae->End = tk->End;
+			ae->End = TkEnd(p, tk);
 
 			break;
 
 		case TT_EOF:
-			ne->End = tk->End;
+			ne->End = TkEnd(p, tk);
 
 			ReportTkError(p, tk, "Unclosed node.");
-			return ne;
+			return false;
 
 		default:
-			ne->End = tk->End;
+			(void)ConsumeToken(p);
+			ne->End = TkEnd(p, tk);
 
 			if (ReportTkError(p, tk, "Expected token after attribute key."))
-				return ne;
+				return false;
 			else
 				continue;
 		}
 	}
 
-	if (tk->Type == TT_DOCUMENT)
+	if (TkType(p, tk) == TT_DOCUMENT)
 	{
 		ne->BodyType = NBT_DOCUMENT;
-		ne->End = tk->End;
-		ne->Document = tk->sValue;
-		ne->DocumentLength = tk->sLength;
+		ne->End = TkEnd(p, tk);
+		ne->Document = TkValue(p, tk)->sValue;
+		ne->DocumentLength = TkValue(p, tk)->sLength;
 		// printf("\tDocument body.\n");
 	}
-	else if (tk->Type == TT_SEMICOLON)
+	else if (TkType(p, tk) == TT_SEMICOLON)
 	{
 		ne->BodyType = NBT_NONE;
-		ne->End = tk->End;
+		ne->End = TkEnd(p, tk);
 		// printf("\tNo body.\n");
 	}
-	else if (tk->Type == TT_BRACKET_OPEN)
+	else if (TkType(p, tk) == TT_BRACKET_OPEN)
 	{
 		ne->BodyType = NBT_CHILDREN;
-		Node * * nextNode = &(ne->Children);
 
-		while ((tk = PeekToken(p))->Type != TT_BRACKET_CLOSE)
+		return true;
+	}
+	else if (TkType(p, tk) == TT_EOF)
+	{
+		ne->End = TkEnd(p, tk);
+
+		ReportTkError(p, tk, "Unclosed node.");
+	}
+	else
+	{
+		ne->End = TkEnd(p, tk);
+
+		ReportTkError(p, tk, "Unexpected token in node.");
+	}
+
+	return false;
+}
+
+//	While reparsing, the old tree is walked in document order alongside the
+//	parse, so the nodes which the edit didn't reach can be picked up whole
+//	when the parse gets to where they start.
+typedef struct FmlReuse_s
+{
+	Node * next;		//	The first old node not yet gone past.
+	size_t depth;		//	Of `next`, in the old tree.
+
+	size_t firstToken;	//	The first token lexed again,
+	size_t prefixEnd;	//	where lexing picked up,
+	size_t suffixToken;	//	and the first token after those.
+
+	char const * oldInput;
+	size_t oldSize;
+	char const * newInput;
+	size_t shift;		//	Wraps around when the input got shorter.
+} FmlReuse;
+
+static void SkipOldSubtree(FmlReuse * r)
+{
+	Node const * n = r->next;
+
+	while (n->Next == NULL && n->Parent != NULL)
+	{
+		n = n->Parent;
+		--r->depth;
+	}
+
+	r->next = n->Next;
+}
+
+//	Moves on to the first old node which doesn't start before `at`, only
+//	going into the ones which hold it.
+static void AdvanceReuse(FmlReuse * r, size_t at)
+{
+	while (r->next != NULL && r->next->Start < at)
+		if (r->next->BodyType == NBT_CHILDREN && r->next->Children != NULL && r->next->End >= at)
+		{
+			r->next = r->next->Children;
+			++r->depth;
+		}
+		else
+			SkipOldSubtree(r);
+}
+
+//	Slices of the old input are moved to the same text in the new one;
+//	strings unescaped in an arena stay where they are.
+static inline char const * MoveString(FmlReuse const * r, char const * str, size_t shift)
+{
+	if (str >= r->oldInput && str <= r->oldInput + r->oldSize)
+		return r->newInput + ((size_t)(str - r->oldInput) + shift);
+
+	return str;
+}
+
+//	Moves a node over to the new input, without its children.
+static void MoveNode(FmlReuse const * r, Node * n, size_t shift)
+{
+	n->Start += shift;
+	n->End += shift;
+	n->Name = MoveString(r, n->Name, shift);
+
+	if (n->Id != NULL)
+		n->Id = MoveString(r, n->Id, shift);
+
+	if (n->BodyType == NBT_DOCUMENT)
+		n->Document = MoveString(r, n->Document, shift);
+
+	for (Class * cl = n->Classes; cl != NULL; cl = cl->Next)
+	{
+		cl->Start += shift;
+		cl->End += shift;
+		cl->Name = MoveString(r, cl->Name, shift);
+	}
+
+	for (Attribute * at = n->Attributes; at != NULL; at = at->Next)
+	{
+		at->Start += shift;
+		at->End += shift;
+		at->Key = MoveString(r, at->Key, shift);
+
+		switch (at->ValueType)
+		{
+		case AVT_STRING:
+		case AVT_IDENTIFIER:
+		case AVT_REFERENCE:
+			at->sValue = MoveString(r, at->sValue, shift);
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+static void MoveSubtree(FmlReuse const * r, Node * n, size_t shift)
+{
+	Node * m = n;
+
+	for (;;)
+	{
+		MoveNode(r, m, shift);
+
+		if (m->BodyType == NBT_CHILDREN && m->Children != NULL)
 		{
-			if (tk->Type != TT_IDENTIFIER)
+			m = m->Children;
+			continue;
+		}
+
+		while (m != n && m->Next == NULL)
+			m = m->Parent;
+
+		if (m == n)
+			break;
+
+		m = m->Next;
+	}
+}
+
+//	Returns the old node which starts at the given token, if it can stand
+//	for what parsing from there would give, and skips its tokens.
+//	Moves on to the token after `last`. The parser may look back at the last
+//	token it consumed, so the last two are read in.
+static void SkipPast(ParserState * p, size_t last)
+{
+	p->tokenIndex = p->tokensRead = last - 1;
+	(void)ConsumeToken(p);
+	(void)ConsumeToken(p);
+}
+
+static Node * ReuseNode(ParserState * p, size_t tk, size_t depth)
+{
+	FmlReuse * const r = p->reuse;
+	TokenStream const * const ts = &(p->lexer->Tokens);
+	bool const after = tk >= r->suffixToken;
+
+	if (tk >= r->firstToken && !after)
+		return NULL;
+
+	size_t const shift = after ? r->shift : 0;
+
+	AdvanceReuse(r, TkStart(p, tk) - shift);
+
+	Node * const n = r->next;
+
+	if (n == NULL || n->Start != TkStart(p, tk) - shift
+		|| (!after && n->End >= r->prefixEnd)
+		//	The same tokens only give the same nesting errors at the same depth.
+		|| (p->MaxDepth != 0 && r->depth != depth))
+		return NULL;
+
+	//	The last token of the node is searched for by galloping from the
+	//	first, as most nodes are short.
+	size_t const end = n->End + shift;
+	size_t lo = tk + 1, hi = tk + 2;
+
+	while (hi < ts->Count && ts->Starts[hi] <= end)
+	{
+		lo = hi + 1;
+		hi = tk + 2 * (hi - tk);
+	}
+
+	if (hi > ts->Count)
+		hi = ts->Count;
+
+	while (lo < hi)
+	{
+		size_t const mid = lo + (hi - lo) / 2;
+
+		if (ts->Starts[mid] <= end)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	size_t const last = lo - 1;
+
+	//	A node which was given up on, or which parsing stopped in, depends on
+	//	what came after it. Only those which were closed end with their own
+	//	closing bracket.
+	if (n->BodyType == NBT_CHILDREN && (ts->Types[last] != TT_BRACKET_CLOSE
+		|| (n->LastChild != NULL && n->LastChild->End >= n->End)))
+		return NULL;
+
+	SkipOldSubtree(r);
+
+	if (shift != 0 || r->newInput != r->oldInput)
+		MoveSubtree(r, n, shift);
+
+	n->Next = NULL;
+
+	//	The node's last two tokens are after its first one, as the shortest
+	//	node is an identifier and EOF, which is never consumed.
+	SkipPast(p, last);
+
+	return n;
+}
+
+//	Nodes are nested without recursion: the ones whose children are being
+//	parsed are kept on a stack, so the depth is only limited by memory, or
+//	by the options.
+//	Hands the head of a node over to the handlers, and ends it too if it has
+//	no children to wait for. Returns true if they asked to stop.
+static bool BeginNode(ParserState * p, Node const * n, bool hasChildren)
+{
+	FmlParserHandlers const * const h = p->Handlers;
+
+	if (h->NodeBegin != NULL && (p->Stopped = h->NodeBegin(p, n)))
+		return true;
+
+	if (h->Class != NULL)
+		for (Class const * cl = n->Classes; cl != NULL; cl = cl->Next)
+			if ((p->Stopped = h->Class(p, n, cl)))
+				return true;
+
+	if (h->Id != NULL && n->Id != NULL && (p->Stopped = h->Id(p, n)))
+		return true;
+
+	if (h->Attribute != NULL)
+		for (Attribute const * at = n->Attributes; at != NULL; at = at->Next)
+			if ((p->Stopped = h->Attribute(p, n, at)))
+				return true;
+
+	if (h->Document != NULL && n->BodyType == NBT_DOCUMENT && (p->Stopped = h->Document(p, n)))
+		return true;
+
+	return !hasChildren && h->NodeEnd != NULL && (p->Stopped = h->NodeEnd(p, n));
+}
+
+//	Returns true if the handlers asked to stop, now or before.
+static bool EndNode(ParserState * p, Node const * n)
+{
+	if (p->Handlers != NULL && !p->Stopped && p->Handlers->NodeEnd != NULL)
+		p->Stopped = p->Handlers->NodeEnd(p, n);
+
+	return p->Stopped;
+}
+
+//	Returns the index of the bracket which closes the body whose children
+//	start at `tk`, or 0 if it isn't closed.
+static size_t FindClosingBracket(ParserState const * p, size_t tk)
+{
+	TokenStream const * const ts = &(p->lexer->Tokens);
+	size_t const end = p->tokenLimit < ts->Count ? p->tokenLimit : ts->Count;
+
+	for (size_t depth = 0; tk < end; ++tk)
+		if (ts->Types[tk] == TT_BRACKET_OPEN)
+			++depth;
+		else if (ts->Types[tk] == TT_BRACKET_CLOSE && depth-- == 0)
+			return tk;
+
+	return 0;
+}
+
+//	Parses the top-level nodes, or else the children of `root`, which are at
+//	depth `base`.
+static ParserState * ParseTokens(ParserState * p, Node * root, size_t base)
+{
+	Node * * stack = NULL;
+	size_t depth = 0, capacity = 0;
+	size_t tk;
+
+	//	Without a tree, open nodes are kept here, one per depth, as the arena
+	//	only holds the head of the latest node.
+	Node * * open = NULL;
+	size_t openCount = 0;
+
+	for (;;)
+	{
+		Node * const parent = depth > 0 ? stack[depth - 1] : root;
+		tk = PeekToken(p);
+
+		if (parent == NULL)
+		{
+			if (TkType(p, tk) == TT_EOF)
+				break;
+
+			if (TkType(p, tk) != TT_IDENTIFIER)
+			{
+				if (ReportTkError(p, tk, "Expected identifier to start top-level node."))
+					break;
+
+				ConsumeToken(p);
+				continue;
+			}
+		}
+		else
+		{
+			if (TkType(p, tk) == TT_BRACKET_CLOSE)
+			{
+				parent->End = TkEnd(p, tk);
+				(void)ConsumeToken(p);	//	Consumes the closing bracket.
+
+				if (depth == 0)
+					break;	//	That was the root's.
+
+				--depth;
+
+				if (EndNode(p, parent))
+					break;
+
+				continue;
+			}
+
+			if (TkType(p, tk) != TT_IDENTIFIER)
 			{
+				//	Giving up on a node leaves its parent to carry on.
 				if (ReportTkError(p, tk, "Expected identifier to start child node.")
-					|| tk->Type == TT_EOF)
-					return ne;
-				else
+					|| TkType(p, tk) == TT_EOF)
 				{
-					ConsumeToken(p);
-					continue;
+					parent->End = TkEnd(p, p->tokenIndex - 1);
+
+					if (depth == 0)
+						break;
+
+					--depth;
+
+					if (EndNode(p, parent))
+						break;
 				}
+				else
+					ConsumeToken(p);
+
+				continue;
 			}
 
 			// printf("\tChild:\n");
+		}
+
+		if (p->Handlers != NULL)
+		{
+			FmlResetArena(p->Arena);
 
-			ne->LastChild = *nextNode = ParseNode(p);
-			nextNode = &((*nextNode)->Next);
-			ne->ChildrenCount++;
+			//	So is a pulling lexer's, which only holds unescaped strings;
+			//	the name at hand is never one of them.
+			if (p->source != NULL && p->source->OwnsArena)
+				FmlResetArena(p->source->Arena);
 		}
 
-		ne->End = tk->End;
-		(void)ConsumeToken(p);	//	Consumes the closing bracket.
-	}
-	else if (tk->Type == TT_EOF)
-	{
-		ne->End = tk->End;
+		Node * ne = p->reuse != NULL ? ReuseNode(p, tk, base + depth) : NULL;
+		bool const hasChildren = ne == NULL && ParseNodeHead(p, &ne);
+		ne->Parent = parent;
 
-		ReportTkError(p, tk, "Unclosed node.");
+		if (p->Handlers != NULL)
+		{
+			if (BeginNode(p, ne, hasChildren))
+				break;
+		}
+		else if (parent == NULL)
+		{
+			if (p->LastNode == NULL)
+				p->Nodes = ne;
+			else
+				p->LastNode->Next = ne;
+
+			p->LastNode = ne;
+		}
+		else
+		{
+			if (parent->LastChild == NULL)
+				parent->Children = ne;
+			else
+				parent->LastChild->Next = ne;
+
+			parent->LastChild = ne;
+			parent->ChildrenCount++;
+		}
+
+		if (!hasChildren)
+			continue;
+
+		tk = p->tokenIndex - 1;	//	The opening bracket.
+
+		//	Parsing stops altogether, as there's no telling where the rest
+		//	of the nodes would go.
+		if (p->MaxDepth != 0 && base + depth >= p->MaxDepth)
+		{
+			ne->End = TkEnd(p, tk);
+			ReportTkError(p, tk, "Nodes are nested too deeply.");
+			EndNode(p, ne);
+			break;
+		}
+
+		//	A lazy body is skipped in one go, if it's closed.
+		size_t const close = p->lazy ? FindClosingBracket(p, tk + 1) : 0;
+
+		if (close != 0)
+		{
+			ne->BodyType = NBT_LAZY;
+			ne->bodyStart = tk + 1;
+			ne->bodyEnd = close;
+			ne->depth = base + depth;
+			ne->End = p->lexer->Tokens.Ends[close];
+			SkipPast(p, close);
+			continue;
+		}
+
+		if (depth == capacity)
+		{
+			size_t const newCap = capacity < 64 ? 64 : capacity * 2;
+			Node * * newStack = realloc(stack, newCap * sizeof(Node *));
+
+			if (newStack == NULL)
+			{
+				ne->End = TkEnd(p, tk);
+				ReportTkError(p, tk, "Out of memory.");
+				EndNode(p, ne);
+				break;
+			}
+
+			stack = newStack;
+			capacity = newCap;
+		}
+
+		if (p->Handlers != NULL)
+		{
+			if (depth == openCount)
+			{
+				Node * * newOpen = realloc(open, capacity * sizeof(Node *));
+				Node * const slot = newOpen != NULL ? malloc(sizeof(Node)) : NULL;
+
+				if (newOpen != NULL)
+					open = newOpen;
+
+				if (slot == NULL)
+				{
+					ne->End = TkEnd(p, tk);
+					ReportTkError(p, tk, "Out of memory.");
+					EndNode(p, ne);
+					break;
+				}
+
+				open[openCount++] = slot;
+			}
+
+			//	What's in the arena goes with the next node.
+			*open[depth] = *ne;
+			ne = open[depth];
+			ne->Classes = NULL;
+			ne->Attributes = NULL;
+		}
+
+		stack[depth++] = ne;
 	}
-	else
-	{
-		ne->End = tk->End;
 
-		ReportTkError(p, tk, "Unexpected token in node.");
+	//	Nodes left open end with the last token they got.
+	while (depth > 0)
+	{
+		Node * const n = stack[--depth];
+		n->End = TkEnd(p, p->tokenIndex - 1);
+		EndNode(p, n);
 	}
 
-	return ne;
+	free(stack);
+
+	for (size_t i = 0; i < openCount; ++i)
+		free(open[i]);
+
+	free(open);
+
+	return p;
 }
 
 ParserState * Parse(LexerState const * l, ParserErrorSink ers)
+{
+	return ParseEx(l, ers, NULL);
+}
+
+static ParserState * CreateParserState(LexerState const * l, ParserErrorSink ers, ParserOptions const * opts)
 {
 	ParserState * p = calloc(1, sizeof(ParserState));
 	p->lexer = l;
+	p->tokenLimit = SIZE_MAX;
 	p->ErrorSink = ers;
-	p->curToken = NULL;
+	p->Symbols = opts != NULL ? opts->Symbols : NULL;
+	p->MaxDepth = opts != NULL ? opts->MaxDepth : 0;
 
-	Node * * nextNode = &(p->Nodes);
-	Token const * tk;
+	if (opts != NULL && opts->IndexIds)
+		p->Ids = FmlCreateIdIndex();
 
-	while ((tk = PeekToken(p))->Type != TT_EOF)
+	if (opts != NULL && opts->IndexClasses)
 	{
-		if (tk->Type != TT_IDENTIFIER)
+		if (p->Symbols == NULL)
 		{
-			if (ReportTkError(p, tk, "Expected identifier to start top-level node."))
-				return p;
-			else
-			{
-				ConsumeToken(p);
-				continue;
-			}
+			p->Symbols = FmlCreateSymbolTable();
+			p->OwnsSymbols = true;
 		}
 
-		p->LastNode = *nextNode = ParseNode(p);
-		nextNode = &((*nextNode)->Next);
+		if (p->Symbols != NULL)
+			p->Classes = FmlCreateClassIndex();
 	}
 
+	if (opts != NULL && opts->Arena != NULL)
+		p->Arena = opts->Arena;
+	else
+	{
+		p->Arena = FmlCreateArena(0);
+		p->OwnsArena = true;
+	}
+
+	pthread_mutex_init(&(p->lock), NULL);
+
 	return p;
 }
 
-void FreeParserState(ParserState * p)
+//	Parallel parsing splits the token stream between top-level nodes, found
+//	by the depth of the brackets, and each piece is parsed on its own, as if
+//	it were the whole stream, into an arena of its own. A piece only comes out
+//	the way it would've in one go if the parser is at the top level where it
+//	starts, which is certain for the first one and, after that, for every
+//	piece which followed a piece without errors: the parser only gets to see
+//	the EOF at the end of a piece at the top level, or else it complains.
+//	So if there are any errors, everything is parsed again in one go, and they
+//	are only reported then. Symbols and indexes depend on the order in which
+//	things are seen, so they're left out of the pieces and filled in after.
+
+#ifndef FML_PARSE_MIN_CHUNK
+#define FML_PARSE_MIN_CHUNK ((size_t)1 << 16)
+#endif
+
+typedef struct ChunkParser_s
 {
-	//	Freeing the node tree is done iteratively - it's actually flattened.
+	ParserState parser;	//	Must come first.
 
-	for (Node * n = p->Nodes; n != NULL; /* nothing */)
-	{
-		for (Attribute const * at = n->Attributes; at != NULL; /* nothing */)
-		{
-			Attribute const * atNext = at->Next;
-			free((void *)at);
-			at = atNext;
-		}
+	bool Failed;
+} ChunkParser;
 
-		for (Class const * cl = n->Classes; cl != NULL; /* nothing */)
-		{
-			Class const * clNext = cl->Next;
-			free((void *)cl);
-			cl = clNext;
-		}
+static bool RecordChunkError(ParserState * p, size_t loc, size_t cnt, char const * err)
+{
+	(void)loc;
+	(void)cnt;
+	(void)err;
 
-		if (n->BodyType == NBT_CHILDREN && n->LastChild != NULL)
-		{
-			n->LastChild->Next = n->Next;
-			n->Next = n->Children;
-			//	This turns this node's children into its siblings! :DDD
-		}
+	((ChunkParser *)p)->Failed = true;
+
+	return true;	//	The piece is of no use anymore.
+}
+
+static void * ParseChunk(void * arg)
+{
+	ParseTokens(&(((ChunkParser *)arg)->parser), NULL, 0);
+
+	return NULL;
+}
+
+//	Picks where each of at most `n` pieces starts: at the first top-level node
+//	past an even share of the tokens. Returns how many pieces there are.
+static size_t SplitTokens(TokenStream const * ts, size_t * starts, size_t n)
+{
+	size_t const count = ts->Count - 1;	//	Not counting EOF.
+	size_t depth = 0, k = 1;
+
+	starts[0] = 0;
 
-		Node * nNext = n->Next;
-		free(n);
-		n = nNext;
+	for (size_t i = 1; i < count && k < n; ++i)
+	{
+		uint8_t const prev = ts->Types[i - 1];
+
+		if (prev == TT_BRACKET_OPEN)
+			++depth;
+		else if (prev == TT_BRACKET_CLOSE && depth > 0)
+			--depth;
+
+		//	Nodes end with a semicolon, a document or a closing bracket.
+		if (depth == 0 && i >= count * k / n && ts->Types[i] == TT_IDENTIFIER
+			&& (prev == TT_SEMICOLON || prev == TT_DOCUMENT || prev == TT_BRACKET_CLOSE))
+			starts[k++] = i;
 	}
 
-	free(p);
+	return k;
 }
 
-bool ReportParserErrorDefault(ParserState * p, size_t loc, size_t cnt, char const * err)
+//	Fills in the symbols and indexes in the order parsing in one go would've,
+//	reporting duplicate IDs likewise.
+static void FinishParallelParse(ParserState * p)
 {
-	long line = 1, i
-		, nlBeforeStart = -1, nlBeforeEnd = -1
-		, wsBeforeStart = -1, wsBeforeEnd = -1
-		, nlAfterStart = -1, nlAfterEnd = -1;
+	if (p->Symbols == NULL && p->Ids == NULL)
+		return;
+
+	for (Node * n = p->Nodes; n != NULL; n = FmlNextNode(n))
+	{
+		n->NameSymbol = InternName(p, n->Name, n->NameLength);
 
-	//	Find the start of the line where the error starts, as well as
-	//	the line number.
-	for (i = 0; i < (long)loc; ++i)
-		if (p->lexer->Input[i] == '\n')
+		for (Class * cl = n->Classes; cl != NULL; cl = cl->Next)
 		{
-			nlBeforeStart = wsBeforeStart = i;
-			++line;
-		}
-		else if (wsBeforeStart == i - 1)
-			switch (p->lexer->Input[i])
+			cl->NameSymbol = InternName(p, cl->Name, cl->NameLength);
+
+			if (p->Classes != NULL && !FmlAddClass(p->Classes, cl->NameSymbol, n))
 			{
-			case ' ': case '\t':
-				wsBeforeStart = i;
-			default:
-				break;
+				FmlFreeClassIndex(p->Classes);
+				p->Classes = NULL;
 			}
+		}
 
-	//	Find the end of the line where the error starts.
-	//	Note that this uses a different indexer, as to not affect the next loop.
-	for (long j = i; j <= (long)p->lexer->InputSize; ++j)
-		if (p->lexer->Input[j] == '\n' || p->lexer->Input[j] == '\0')
+		if (n->Id != NULL && p->Ids != NULL)
 		{
-			nlAfterStart = j;
-			break;
+			Node const * const first = FmlAddId(p->Ids, n);
+
+			if (first == NULL)
+			{
+				FmlFreeIdIndex(p->Ids);
+				p->Ids = NULL;
+			}
+			else if (first != n)
+				FmlReportDuplicateId(p, n);
 		}
 
-	//	Find the start of the line where the error ends, as well as
-	//	the line number.
-	for (/* nothing */; i < (long)loc + (long)cnt; ++i)
-		if (p->lexer->Input[i] == '\n')
+		for (Attribute * at = n->Attributes; at != NULL; at = at->Next)
+			at->KeySymbol = InternName(p, at->Key, at->KeyLength);
+	}
+}
+
+//	Parses the whole token stream on several threads, if it's large enough to
+//	be worth it. Returns false, having changed nothing, if it didn't.
+static bool ParseInParallel(ParserState * p, unsigned threads)
+{
+	TokenStream const * const ts = &(p->lexer->Tokens);
+	size_t n = ts->Count / FML_PARSE_MIN_CHUNK;
+
+	if (n > threads)
+		n = threads;
+
+	if (n < 2)
+		return false;
+
+	size_t * starts = calloc(n, sizeof(size_t));
+	ChunkParser * chunks = calloc(n, sizeof(ChunkParser));
+	bool ok = starts != NULL && chunks != NULL && (n = SplitTokens(ts, starts, n)) > 1;
+
+	for (size_t k = 0; ok && k < n; ++k)
+	{
+		ParserState * const c = &(chunks[k].parser);
+
+		c->lexer = p->lexer;
+		c->tokenIndex = c->tokensRead = starts[k];
+		c->tokenLimit = k + 1 < n ? starts[k + 1] : SIZE_MAX;
+		c->ErrorSink = &RecordChunkError;
+		c->MaxDepth = p->MaxDepth;
+		c->lazy = p->lazy;
+		ok = (c->Arena = FmlCreateArena(0)) != NULL;
+	}
+
+	if (ok)
+		FmlRunOnThreads(&ParseChunk, chunks, sizeof(ChunkParser), n);
+
+	for (size_t k = 0; ok && k < n; ++k)
+		ok = !chunks[k].Failed;
+
+	if (chunks != NULL)
+		for (size_t k = 0; k < n; ++k)
 		{
-			nlBeforeEnd = wsBeforeEnd = i;
-			++line;
-		}
-		else if (wsBeforeEnd == i - 1)
-			switch (p->lexer->Input[i])
+			ParserState const * const c = &(chunks[k].parser);
+
+			if (c->Arena == NULL)
+				continue;
+
+			if (!ok)
 			{
-			case ' ': case '\t':
-				wsBeforeEnd = i;
-			default:
-				break;
+				FmlFreeArena(c->Arena);
+				continue;
 			}
 
-	//	Find the end of the line where the error ends.
-	for (/* nothing */; i <= (long)p->lexer->InputSize; ++i)
-		if (p->lexer->Input[i] == '\n' || p->lexer->Input[i] == '\0')
-		{
-			nlAfterEnd = i;
-			break;
+			FmlMergeArena(p->Arena, c->Arena);
+
+			if (c->Nodes == NULL)
+				continue;
+
+			if (p->LastNode == NULL)
+				p->Nodes = c->Nodes;
+			else
+				p->LastNode->Next = c->Nodes;
+
+			p->LastNode = c->LastNode;
 		}
 
-	fprintf(stderr, "%zd:%ld: %s\n", line, (long)loc - nlBeforeStart, err);
+	free(starts);
+	free(chunks);
+
+	if (!ok)
+		return false;
+
+	p->tokenIndex = p->tokensRead = ts->Count - 1;	//	At EOF.
+	FinishParallelParse(p);
+
+	return true;
+}
+
+ParserState * ParseEx(LexerState const * l, ParserErrorSink ers, ParserOptions const * opts)
+{
+	ParserState * p = CreateParserState(l, ers, opts);
+	p->lazy = opts != NULL && opts->LazyBodies;
+
+	if (opts != NULL && opts->Threads > 1 && ParseInParallel(p, opts->Threads))
+		return p;
+
+	return ParseTokens(p, NULL, 0);
+}
+
+ParserState * FmlParseLexer(LexerState * l, ParserErrorSink ers, ParserOptions const * opts)
+{
+	ParserState * p = CreateParserState(l, ers, opts);
+	p->source = l;
+
+	return ParseTokens(p, NULL, 0);
+}
+
+bool FmlParseEvents(LexerState * l, ParserErrorSink ers, ParserOptions const * opts, FmlParserHandlers const * h, void * ctxt)
+{
+	//	Nothing is kept, so there's nothing to index.
+	ParserOptions o = opts != NULL ? *opts : (ParserOptions){ 0 };
+	o.Arena = NULL;
+	o.IndexIds = false;
+	o.IndexClasses = false;
+
+	ParserState * p = CreateParserState(l, ers, &o);
+	p->Handlers = h;
+	p->Context = ctxt;
+
+	if (l->Tokens.Count == 0)
+		p->source = l;
+
+	bool const res = !ParseTokens(p, NULL, 0)->Stopped;
+	FreeParserState(p);
+
+	return res;
+}
+
+void FmlDropIndexes(ParserState * p)
+{
+	if (p->Ids != NULL)
+	{
+		FmlFreeIdIndex(p->Ids);
+		p->Ids = NULL;
+	}
+
+	if (p->Classes != NULL)
+	{
+		FmlFreeClassIndex(p->Classes);
+		p->Classes = NULL;
+	}
+}
+
+bool FmlReparse(ParserState * p, LexerState * l, char const * str, size_t len, FmlEdit const * edit)
+{
+	char const * const oldInput = l->Buffer;
+	size_t const oldSize = l->InputSize;
+	FmlRelexed rx;
+
+	if (p->lexer != l || p->source != NULL || p->Templates != NULL || p->lazy
+		|| !FmlRelex(l, str, len, edit, &rx))
+		return false;
+
+	size_t const shift = edit->Inserted - edit->Removed;
+	FmlReuse r = {
+		.next = p->Nodes,
+		.firstToken = rx.First,
+		.prefixEnd = rx.Offset,
+		.suffixToken = rx.NewEnd,
+		.oldInput = oldInput,
+		.oldSize = oldSize,
+		.newInput = str,
+		.shift = shift,
+	};
+
+	FmlDropIndexes(p);
+
+	p->Nodes = p->LastNode = NULL;
+	p->tokenIndex = p->tokensRead = 0;
+	p->reuse = &r;
+
+	ParseTokens(p, NULL, 0);
+
+	p->reuse = NULL;
+
+	return true;
+}
+
+void FreeParserState(ParserState * p)
+{
+	if (p->Ids != NULL)
+		FmlFreeIdIndex(p->Ids);
+
+	if (p->Classes != NULL)
+		FmlFreeClassIndex(p->Classes);
+
+	if (p->OwnsSymbols)
+		FmlFreeSymbolTable(p->Symbols);
+
+	//	The tree is not freed node by node; it goes away with the arena.
+	if (p->OwnsArena)
+		FmlFreeArena(p->Arena);
+
+	pthread_mutex_destroy(&(p->lock));
+	free(p);
+}
+
+//	Parses the children of a lazy body, as the parser would have, had it not
+//	skipped it; the indexes keep nodes in the order they're parsed in, which
+//	isn't document order anymore.
+static void LoadBody(ParserState * p, Node * n)
+{
+	size_t const first = n->bodyStart, last = n->bodyEnd, depth = n->depth;
+
+	n->Children = n->LastChild = NULL;
+	n->ChildrenCount = 0;
+
+	FmlDropIndexes(p);
+
+	SkipPast(p, first - 1);	//	The opening bracket.
+	p->tokenLimit = last + 1;
+
+	ParseTokens(p, n, depth + 1);
+
+	p->tokenLimit = SIZE_MAX;
+	p->tokenIndex = p->tokensRead = p->lexer->Tokens.Count - 1;	//	At EOF.
+
+	//	Other threads may go by the body type without taking the lock.
+	__atomic_store_n(&(n->BodyType), NBT_CHILDREN, __ATOMIC_RELEASE);
+}
+
+Node * FmlLoadChildren(ParserState * p, Node * n)
+{
+	if (__atomic_load_n(&(n->BodyType), __ATOMIC_ACQUIRE) == NBT_LAZY)
+	{
+		pthread_mutex_lock(&(p->lock));
+
+		if (n->BodyType == NBT_LAZY)
+			LoadBody(p, n);
+
+		pthread_mutex_unlock(&(p->lock));
+	}
+
+	return n->BodyType == NBT_CHILDREN ? n->Children : NULL;
+}
+
+void FmlLoadAll(ParserState * p)
+{
+	for (Node * n = p->Nodes; n != NULL; n = FmlNextNode(n))
+		(void)FmlLoadChildren(p, n);
+}
+
+Node * FmlNextNode(Node const * n)
+{
+	//	Pairs with the store in LoadBody, so a body loaded on another thread is
+	//	seen whole.
+	if (__atomic_load_n(&(n->BodyType), __ATOMIC_ACQUIRE) == NBT_CHILDREN && n->Children != NULL)
+		return n->Children;
+
+	for (/* nothing */; n != NULL; n = n->Parent)
+		if (n->Next != NULL)
+			return n->Next;
+
+	return NULL;
+}
+
+bool ReportParserErrorDefault(ParserState * p, size_t loc, size_t cnt, char const * err)
+{
+	char const * const input = p->lexer->Input;
+	size_t const size = p->lexer->InputSize;
+
+	if (loc > size)
+		loc = size;
+
+	if (cnt > size - loc)
+		cnt = size - loc;
+
+	FmlLocation const start = FmlLocate(p->lexer, loc), end = FmlLocate(p->lexer, loc + cnt);
+	long const nlBeforeStart = (long)(start.LineStart) - 1;
+	long wsBeforeStart = nlBeforeStart, nlAfterStart = (long)(start.LineEnd);
+
+	//	The indentation of the line is copied before the caret, so it lines up
+	//	with tabs too.
+	for (size_t i = start.LineStart; i < loc && (input[i] == ' ' || input[i] == '\t'); ++i)
+		wsBeforeStart = (long)i;
+
+	//	The line is only shown up to a null character after the error.
+	char const * const nul = memchr(input + loc, '\0', start.LineEnd - loc);
+
+	if (nul != NULL)
+		nlAfterStart = nul - input;
+
+	fprintf(stderr, "%zu:%zu: %s\n", start.Line, start.Column, err);
 
 	if (nlAfterStart > nlBeforeStart)
 	{
-		if (nlBeforeStart < nlBeforeEnd)
+		if (end.Line > start.Line)
 		{
 			//	Error starts and ends on different lines.
 
@@ -397,11 +1228,11 @@ bool ReportParserErrorDefault(ParserState * p, size_t loc, size_t cnt, char cons
 		{
 			//	Error starts and ends on the same line.
 
-			fwrite(p->lexer->Input + nlBeforeStart + 1, nlAfterStart - nlBeforeStart - 1, 1, stderr);
+			fwrite(input + nlBeforeStart + 1, nlAfterStart - nlBeforeStart - 1, 1, stderr);
 			putc('\n', stderr);
 
 			if (wsBeforeStart > nlBeforeStart)
-				fwrite(p->lexer->Input + nlBeforeStart + 1, wsBeforeStart - nlBeforeStart, 1, stderr);
+				fwrite(input + nlBeforeStart + 1, wsBeforeStart - nlBeforeStart, 1, stderr);
 
 			if ((long)loc > wsBeforeStart)
 				fprintf(stderr, "%*.s^", (int)(loc - wsBeforeStart - 1), "");
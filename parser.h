@@ -1,6 +1,8 @@
 #pragma once
 
 #include "lexer.h"
+#include "symbols.h"
+#include <pthread.h>
 
 enum EXPRESSION_TYPES
 {
@@ -17,6 +19,7 @@ typedef struct Class_s
 
 	char const * Name;
 	size_t NameLength;
+	FmlSymbol NameSymbol;
 	struct Class_s * Next;
 } Class;
 
@@ -32,6 +35,7 @@ typedef struct Attribute_s
 
 	char const * Key;
 	size_t KeyLength;
+	FmlSymbol KeySymbol;
 
 	enum ATTRIBUTE_VALUE_TYPES ValueType;
 
@@ -52,7 +56,9 @@ typedef struct Attribute_s
 
 enum NODE_BODY_TYPES
 {
-	NBT_NONE, NBT_CHILDREN, NBT_DOCUMENT
+	NBT_NONE, NBT_CHILDREN, NBT_DOCUMENT,
+	NBT_EXPANDED,	//	A template instance; see template.h.
+	NBT_LAZY,		//	Children not parsed yet; see FmlLoadChildren.
 };
 
 typedef struct Node_s
@@ -60,9 +66,12 @@ typedef struct Node_s
 	EXPRESSION_BASE
 
 	char const * Name;
+	size_t NameLength;
+	FmlSymbol NameSymbol;
 
 	Class * Classes;
 	char const * Id;
+	size_t IdLength;
 
 	Attribute * Attributes;
 
@@ -70,7 +79,7 @@ typedef struct Node_s
 
 	union
 	{
-		struct
+		struct	//	NBT_CHILDREN and NBT_EXPANDED
 		{
 			struct Node_s * Children, * LastChild;
 			size_t ChildrenCount;
@@ -81,27 +90,172 @@ typedef struct Node_s
 			char const * Document;
 			size_t DocumentLength;
 		};
+
+		struct	//	NBT_LAZY
+		{
+			size_t bodyStart, bodyEnd;	//	After the opening bracket, and the closing one.
+			size_t depth;				//	Of the node itself.
+		};
 	};
 
 	struct Node_s * Next;
+	struct Node_s * Parent;	//	Null for top-level nodes.
 } Node;
 
 struct ParserState_s;
 typedef struct ParserState_s ParserState;
 
+struct FmlIdIndex_s;
+struct FmlClassIndex_s;
+struct FmlReuse_s;
+
 typedef bool (*ParserErrorSink)(ParserState * p, size_t loc, size_t cnt, char const * err);
 
+//	What `FmlParseEvents` calls as it goes; any of these may be null, and each
+//	returns true to stop the parsing. The node, and whatever it holds, is only
+//	valid during the call, but its Parent chain reaches all the open nodes.
+typedef struct FmlParserHandlers_s
+{
+	//	Once the node's head is parsed, so it has its name, classes, ID and
+	//	attributes, which are then also handed over one by one, below.
+	bool (*NodeBegin)(ParserState * p, Node const * n);
+	bool (*Class)(ParserState * p, Node const * n, Class const * cl);
+	bool (*Id)(ParserState * p, Node const * n);
+	bool (*Attribute)(ParserState * p, Node const * n, Attribute const * at);
+	bool (*Document)(ParserState * p, Node const * n);
+
+	//	After its children, if any, with its End filled in. By now, a node with
+	//	children has no classes or attributes left to look at.
+	bool (*NodeEnd)(ParserState * p, Node const * n);
+} FmlParserHandlers;
+
+//	How many of the latest tokens the parser can look at; a power of two.
+//	It only ever needs the last one consumed and the one after.
+#define FML_PARSER_LOOKAHEAD 4
+
 struct ParserState_s
 {
 	LexerState const * lexer;
-	Token const * curToken;
+	LexerState * source;	//	Tokens are pulled from here when it's not null.
+	size_t tokenIndex;	//	Index of the next token to consume.
+	size_t tokensRead;
+	size_t tokenLimit;	//	Tokens from here on read as EOF.
+	Token window[FML_PARSER_LOOKAHEAD];	//	The latest tokens, by index.
 
 	ParserErrorSink ErrorSink;
+	FmlSymbolTable * Symbols;
+	bool OwnsSymbols;
+	size_t MaxDepth;
+
+	//	See index.h; null until built.
+	struct FmlIdIndex_s * Ids;
+	struct FmlClassIndex_s * Classes;
+
+	FmlArena * Arena;	//	The nodes, classes and attributes live here.
+	bool OwnsArena;
 
 	Node * Nodes, * LastNode;
+	Node * Templates;	//	Taken out of the tree by FmlExpandTemplates.
+
+	struct FmlReuse_s * reuse;	//	Only while reparsing.
+
+	bool lazy;
+	pthread_mutex_t lock;	//	Taken while loading lazy bodies.
+
+	//	Without handlers, the tree is built; see FmlParseEvents.
+	FmlParserHandlers const * Handlers;
+	void * Context;	//	For the handlers to use.
+	bool Stopped;	//	By a handler.
 };
 
+typedef struct ParserOptions_s
+{
+	//	When given, the names of nodes and classes and the keys of attributes
+	//	are interned here, and their symbols are filled in; otherwise those
+	//	are 0. The table may be shared with other documents.
+	FmlSymbolTable * Symbols;
+
+	//	When given, the tree is allocated from this arena and it is left alone
+	//	by `FreeParserState`; the caller may reset and reuse it after.
+	FmlArena * Arena;
+
+	//	How many node bodies may be nested within each other; with 1, top-level
+	//	nodes may have children, but those can't have any of their own. Going
+	//	deeper is reported as an error and ends the parsing. 0 means there is
+	//	no limit other than memory.
+	size_t MaxDepth;
+
+	//	IDs are indexed as they're parsed, and duplicates are reported along
+	//	with the other errors. Otherwise, the index is only built on demand.
+	bool IndexIds;
+
+	//	Likewise for classes. Without a symbol table, one is made for the
+	//	document, as classes are indexed by symbol.
+	bool IndexClasses;
+
+	//	Large token streams are split between top-level nodes, and the pieces
+	//	are parsed on this many threads (by `ParseEx` only); 0 and 1 mean only
+	//	the calling thread is used. The tree, symbols and errors are the same
+	//	either way: if any piece has errors, the whole stream is parsed again
+	//	on the calling thread.
+	unsigned Threads;
+
+	//	Bodies with children are skipped over, to their closing bracket, and
+	//	left as NBT_LAZY; see `FmlLoadChildren`. Only used by `ParseEx`, as the
+	//	token stream is needed to parse them later.
+	bool LazyBodies;
+} ParserOptions;
+
 ParserState * Parse(LexerState const * l, ParserErrorSink ers);
+ParserState * ParseEx(LexerState const * l, ParserErrorSink ers, ParserOptions const * opts);
+
+//	Parses while lexing: tokens are pulled from `l` (made by `FmlCreateLexer`)
+//	only as the parser gets to them, so no token stream is ever built.
+//	The lexer must outlive the parser state, as node values point into it.
+ParserState * FmlParseLexer(LexerState * l, ParserErrorSink ers, ParserOptions const * opts);
+
+//	Parses without building a tree, telling the handlers about each node
+//	instead, in document order. When `l` has no token stream (it's made by
+//	`FmlCreateLexer`), tokens are pulled from it as they're needed, and the
+//	strings it unescapes are let go of with the node they're in, so memory
+//	use only grows with how deeply the nodes are nested. That's unless `l`
+//	was given an arena of its own, which is left alone, and keeps every
+//	unescaped string of read-only input. The arena and the indexes in the
+//	options are ignored. Returns false if a handler stopped the parsing.
+bool FmlParseEvents(LexerState * l, ParserErrorSink ers, ParserOptions const * opts, FmlParserHandlers const * h, void * ctxt);
+
+//	Brings a document parsed from the token stream of `l` in line with an
+//	edit of its input, after passing the edit on to `FmlRelex`. Nodes whose
+//	tokens weren't lexed again are kept, moved along with their text, so only
+//	what's around the edit is parsed again, and only errors there are
+//	reported. The nodes which are dropped stay in the arena until the state is
+//	freed, and the indexes are dropped, to be built again on demand.
+//	Returns false, changing nothing, if `FmlRelex` does, or if the document
+//	had its templates expanded or was parsed with lazy bodies.
+bool FmlReparse(ParserState * p, LexerState * l, char const * str, size_t len, FmlEdit const * edit);
+
+//	Frees the ID and class indexes, for them to be built again on demand.
+//	Needed after changing the tree by hand, as they're not kept up to date.
+void FmlDropIndexes(ParserState * p);
 void FreeParserState(ParserState * p);
 
+//	Returns the first child of `n`, or null if it has none, parsing its body
+//	first if it's NBT_LAZY. Children are parsed one level at a time, so their
+//	own bodies are lazy in turn. Lazy bodies aren't entered by `FmlNextNode`,
+//	so the indexes and selectors only see what's been loaded; the indexes are
+//	dropped on every load, to be built again on demand. Errors in a body are
+//	reported as it's loaded, and stopping only stops that body.
+//	Loads may happen on several threads at once, and alongside walks with
+//	`FmlNextNode`, as long as nothing else changes the tree meanwhile. The
+//	indexes and selectors aren't safe to use while loads are going on, as a
+//	load may free the indexes under them; they're for one thread at a time.
+Node * FmlLoadChildren(ParserState * p, Node * n);
+
+//	Loads every lazy body, so the whole tree is there.
+void FmlLoadAll(ParserState * p);
+
+//	Returns the node after `n` in document order (which is the order in
+//	which they start), or null after the last one.
+Node * FmlNextNode(Node const * n);
+
 bool ReportParserErrorDefault(ParserState * p, size_t loc, size_t cnt, char const * err);
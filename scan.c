@@ -0,0 +1,426 @@
+#include "scan.h"
+#include "utils.char.h"
+#include <string.h>
+
+#if !defined(FML_NO_SIMD) && (defined(__x86_64__) || defined(__i386__))
+#define FML_SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef char const * (*ScanKernel)(char const * str, char const * end);
+
+static char const * SkipWhitespaceScalar(char const * str, char const * end)
+{
+	while (str < end && FmlCharIs(*str, CC_WHITESPACE))
+		++str;
+
+	return str;
+}
+
+static char const * SkipUtf8Scalar(char const * str, char const * end);
+
+static char const * SkipIdentifierScalar(char const * str, char const * end)
+{
+	char const * next;
+
+	while (str < end)
+	{
+		while (FmlCharIs(*str, CC_IDENTIFIER))
+			if (++str == end)
+				return end;
+
+		if (!FmlCharIs(*str, CC_UTF8_FIRST) || (next = SkipUtf8Scalar(str, end)) == str)
+			return str;
+
+		str = next;
+	}
+
+	return end;
+}
+
+static char const * SkipStringTextScalar(char const * str, char const * end)
+{
+	char const * next;
+
+	while (str < end)
+	{
+		while (FmlCharIs(*str, CC_STRING_TEXT))
+			if (++str == end)
+				return end;
+
+		if (!FmlCharIs(*str, CC_UTF8_FIRST) || (next = SkipUtf8Scalar(str, end)) == str)
+			return str;
+
+		str = next;
+	}
+
+	return end;
+}
+
+static char const * SkipUtf8Scalar(char const * str, char const * end)
+{
+	while (str < end)
+	{
+		int cont;
+
+		switch ((unsigned char)*str)
+		{
+		case 192 ... 223: cont = 1; break;
+		case 224 ... 239: cont = 2; break;
+		case 240 ... 247: cont = 3; break;
+
+		default:
+			return str;
+		}
+
+		if (end - str <= cont)
+			return str;
+
+		for (int i = 1; i <= cont; ++i)
+			if (((unsigned char)str[i] & 0xC0) != 0x80)
+				return str;
+
+		str += cont + 1;
+	}
+
+	return end;
+}
+
+#ifdef FML_SCAN_X86
+
+//	The UTF-8 kernels work on blocks which start on a sequence boundary.
+//	A block is fine up to its first byte which isn't where it belongs: an ASCII
+//	byte, a continuation byte where a first byte is needed or vice versa.
+//	Scanning resumes at the start of the sequence holding that byte, or at
+//	the start of a sequence cut short by the end of the block.
+
+//	Given the index of the first bad byte of a block (or the block size),
+//	returns the index of the start of the sequence holding it.
+static int Utf8SequenceStart(char const * block, int bad)
+{
+	for (int i = bad - 1; i >= 0 && i >= bad - 3; --i)
+	{
+		unsigned char const b = (unsigned char)block[i];
+
+		if ((b & 0xC0) == 0x80)
+			continue;
+		else if (b < 0x80)
+			break;
+
+		//	`b` is a valid first byte, or the block would've ended before it.
+		int const len = b >= 0xF0 ? 4 : b >= 0xE0 ? 3 : 2;
+
+		if (i + len > bad)
+			return i;
+
+		break;
+	}
+
+	return bad;
+}
+
+__attribute__((target("sse2")))
+static char const * SkipWhitespaceSse2(char const * str, char const * end)
+{
+	__m128i const sp = _mm_set1_epi8(' '), ht = _mm_set1_epi8('\t')
+		, lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+
+	for (/* nothing */; end - str >= 16; str += 16)
+	{
+		__m128i const v = _mm_loadu_si128((__m128i const *)str);
+		__m128i const ws = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, ht)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+		unsigned const mask = ~(unsigned)_mm_movemask_epi8(ws) & 0xFFFFu;
+
+		if (mask != 0)
+			return str + __builtin_ctz(mask);
+	}
+
+	return SkipWhitespaceScalar(str, end);
+}
+
+//	Returns a mask of the bytes which are in the right place within valid
+//	UTF-8 multi-byte sequences, assuming the block starts on a boundary.
+//	`expected` receives the mask of bytes which must be continuation bytes.
+__attribute__((target("sse2")))
+static inline __m128i Utf8GoodSse2(__m128i const v, __m128i * expected)
+{
+	//	Signed comparisons: 0x80-0xBF are -128 to -65, 0xC0-0xFF are -64 to -1.
+	__m128i const high = _mm_cmplt_epi8(v, _mm_setzero_si128());
+	__m128i const cont = _mm_cmplt_epi8(v, _mm_set1_epi8(-64));
+	__m128i const tooLong = _mm_and_si128(high, _mm_cmpgt_epi8(v, _mm_set1_epi8(-9)));
+	__m128i const lead = _mm_andnot_si128(_mm_or_si128(cont, tooLong), high);
+	__m128i const lead3 = _mm_and_si128(lead, _mm_cmpgt_epi8(v, _mm_set1_epi8(-33)));
+	__m128i const lead4 = _mm_and_si128(lead, _mm_cmpgt_epi8(v, _mm_set1_epi8(-17)));
+
+	//	Where continuation bytes are required, based on the preceding first bytes.
+	*expected = _mm_or_si128(_mm_slli_si128(lead, 1)
+		, _mm_or_si128(_mm_slli_si128(lead3, 2), _mm_slli_si128(lead4, 3)));
+
+	return _mm_or_si128(_mm_and_si128(cont, *expected), _mm_andnot_si128(*expected, lead));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i IdentifierAsciiSse2(__m128i const v)
+{
+	//	Setting bit 5 turns upper case letters into lower case ones.
+	__m128i const lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i const alpha = _mm_and_si128(
+		_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+		_mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+	__m128i const digit = _mm_and_si128(
+		_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+		_mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+	__m128i const other = _mm_or_si128(
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('_')),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+
+	return _mm_or_si128(_mm_or_si128(alpha, digit), other);
+}
+
+__attribute__((target("sse2")))
+static char const * SkipIdentifierSse2(char const * str, char const * end)
+{
+	while (end - str >= 16)
+	{
+		__m128i const v = _mm_loadu_si128((__m128i const *)str);
+		__m128i good = IdentifierAsciiSse2(v);
+
+		//	The UTF-8 checks are only needed when there are non-ASCII bytes.
+		if (_mm_movemask_epi8(v) != 0)
+		{
+			__m128i expected;
+			__m128i const utf8 = Utf8GoodSse2(v, &expected);
+
+			good = _mm_or_si128(_mm_andnot_si128(expected, good), utf8);
+		}
+
+		unsigned const mask = ~(unsigned)_mm_movemask_epi8(good) & 0xFFFFu;
+		int const bad = mask != 0 ? __builtin_ctz(mask) : 16;
+		int const next = Utf8SequenceStart(str, bad);
+
+		str += next;
+
+		if (bad < 16 || next == 0)
+			return str;
+	}
+
+	return SkipIdentifierScalar(str, end);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i StringAsciiSse2(__m128i const v)
+{
+	//	The signed comparison also leaves out every non-ASCII byte.
+	__m128i const printable = _mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F));
+	__m128i const special = _mm_or_si128(
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+
+	return _mm_andnot_si128(special, printable);
+}
+
+__attribute__((target("sse2")))
+static char const * SkipStringTextSse2(char const * str, char const * end)
+{
+	while (end - str >= 16)
+	{
+		__m128i const v = _mm_loadu_si128((__m128i const *)str);
+		__m128i good = StringAsciiSse2(v);
+
+		if (_mm_movemask_epi8(v) != 0)
+		{
+			__m128i expected;
+			__m128i const utf8 = Utf8GoodSse2(v, &expected);
+
+			good = _mm_or_si128(_mm_andnot_si128(expected, good), utf8);
+		}
+
+		unsigned const mask = ~(unsigned)_mm_movemask_epi8(good) & 0xFFFFu;
+		int const bad = mask != 0 ? __builtin_ctz(mask) : 16;
+		int const next = Utf8SequenceStart(str, bad);
+
+		str += next;
+
+		if (bad < 16 || next == 0)
+			return str;
+	}
+
+	return SkipStringTextScalar(str, end);
+}
+
+__attribute__((target("sse2")))
+static char const * SkipUtf8Sse2(char const * str, char const * end)
+{
+	while (end - str >= 16)
+	{
+		__m128i const v = _mm_loadu_si128((__m128i const *)str);
+		__m128i expected;
+		unsigned const mask = ~(unsigned)_mm_movemask_epi8(Utf8GoodSse2(v, &expected)) & 0xFFFFu;
+		int const bad = mask != 0 ? __builtin_ctz(mask) : 16;
+		int const next = Utf8SequenceStart(str, bad);
+
+		str += next;
+
+		if (bad < 16 || next == 0)
+			return str;
+	}
+
+	return SkipUtf8Scalar(str, end);
+}
+
+//	Shifts the bytes of `x` up by `n` positions across the whole 256 bits,
+//	shifting in zeros.
+#define SHIFT_BYTES_UP_256(x, n) \
+	_mm256_alignr_epi8((x), _mm256_permute2x128_si256((x), (x), 0x08), 16 - (n))
+
+__attribute__((target("avx2")))
+static char const * SkipWhitespaceAvx2(char const * str, char const * end)
+{
+	__m256i const sp = _mm256_set1_epi8(' '), ht = _mm256_set1_epi8('\t')
+		, lf = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+
+	for (/* nothing */; end - str >= 32; str += 32)
+	{
+		__m256i const v = _mm256_loadu_si256((__m256i const *)str);
+		__m256i const ws = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, ht)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+		unsigned const mask = ~(unsigned)_mm256_movemask_epi8(ws);
+
+		if (mask != 0)
+			return str + __builtin_ctz(mask);
+	}
+
+	return SkipWhitespaceSse2(str, end);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i Utf8GoodAvx2(__m256i const v, __m256i * expected)
+{
+	__m256i const high = _mm256_cmpgt_epi8(_mm256_setzero_si256(), v);
+	__m256i const cont = _mm256_cmpgt_epi8(_mm256_set1_epi8(-64), v);
+	__m256i const tooLong = _mm256_and_si256(high, _mm256_cmpgt_epi8(v, _mm256_set1_epi8(-9)));
+	__m256i const lead = _mm256_andnot_si256(_mm256_or_si256(cont, tooLong), high);
+	__m256i const lead3 = _mm256_and_si256(lead, _mm256_cmpgt_epi8(v, _mm256_set1_epi8(-33)));
+	__m256i const lead4 = _mm256_and_si256(lead, _mm256_cmpgt_epi8(v, _mm256_set1_epi8(-17)));
+
+	*expected = _mm256_or_si256(SHIFT_BYTES_UP_256(lead, 1)
+		, _mm256_or_si256(SHIFT_BYTES_UP_256(lead3, 2), SHIFT_BYTES_UP_256(lead4, 3)));
+
+	return _mm256_or_si256(_mm256_and_si256(cont, *expected), _mm256_andnot_si256(*expected, lead));
+}
+
+__attribute__((target("avx2")))
+static char const * SkipUtf8Avx2(char const * str, char const * end)
+{
+	while (end - str >= 32)
+	{
+		__m256i const v = _mm256_loadu_si256((__m256i const *)str);
+		__m256i expected;
+		unsigned const mask = ~(unsigned)_mm256_movemask_epi8(Utf8GoodAvx2(v, &expected));
+		int const bad = mask != 0 ? __builtin_ctz(mask) : 32;
+		int const next = Utf8SequenceStart(str, bad);
+
+		str += next;
+
+		if (bad < 32 || next == 0)
+			return str;
+	}
+
+	return SkipUtf8Sse2(str, end);
+}
+
+__attribute__((target("avx2")))
+static char const * SkipStringTextAvx2(char const * str, char const * end)
+{
+	__m256i const quote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\')
+		, control = _mm256_set1_epi8(0x1F);
+
+	while (end - str >= 32)
+	{
+		__m256i const v = _mm256_loadu_si256((__m256i const *)str);
+		__m256i good = _mm256_andnot_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+			_mm256_cmpgt_epi8(v, control));
+
+		if (_mm256_movemask_epi8(v) != 0)
+		{
+			__m256i expected;
+			__m256i const utf8 = Utf8GoodAvx2(v, &expected);
+
+			good = _mm256_or_si256(_mm256_andnot_si256(expected, good), utf8);
+		}
+
+		unsigned const mask = ~(unsigned)_mm256_movemask_epi8(good);
+		int const bad = mask != 0 ? __builtin_ctz(mask) : 32;
+		int const next = Utf8SequenceStart(str, bad);
+
+		str += next;
+
+		if (bad < 32 || next == 0)
+			return str;
+	}
+
+	return SkipStringTextSse2(str, end);
+}
+
+#endif
+
+static ScanKernel SkipWhitespaceImpl = &SkipWhitespaceScalar;
+static ScanKernel SkipIdentifierImpl = &SkipIdentifierScalar;
+static ScanKernel SkipUtf8Impl = &SkipUtf8Scalar;
+static ScanKernel SkipStringTextImpl = &SkipStringTextScalar;
+
+__attribute__((constructor))
+static void SelectKernels(void)
+{
+#ifdef FML_SCAN_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		SkipWhitespaceImpl = &SkipWhitespaceAvx2;
+		SkipIdentifierImpl = &SkipIdentifierSse2;
+		SkipUtf8Impl = &SkipUtf8Avx2;
+		SkipStringTextImpl = &SkipStringTextAvx2;
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		SkipWhitespaceImpl = &SkipWhitespaceSse2;
+		SkipIdentifierImpl = &SkipIdentifierSse2;
+		SkipUtf8Impl = &SkipUtf8Sse2;
+		SkipStringTextImpl = &SkipStringTextSse2;
+	}
+#endif
+}
+
+char const * FmlSkipWhitespace(char const * str, char const * end)
+{
+	return SkipWhitespaceImpl(str, end);
+}
+
+char const * FmlSkipIdentifier(char const * str, char const * end)
+{
+	return SkipIdentifierImpl(str, end);
+}
+
+char const * FmlSkipUtf8(char const * str, char const * end)
+{
+	return SkipUtf8Impl(str, end);
+}
+
+char const * FmlSkipStringText(char const * str, char const * end)
+{
+	return SkipStringTextImpl(str, end);
+}
+
+char const * FmlFindByte(char const * str, char const * end, char c)
+{
+	//	The C library's `memchr` already comes with vectorized versions
+	//	picked at runtime, and there's no beating it for a single byte.
+	char const * res = memchr(str, c, (size_t)(end - str));
+
+	return res != NULL ? res : end;
+}
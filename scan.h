@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdlib.h>
+
+//	Byte scanning kernels used by the lexer.
+//	SSE2 and AVX2 versions are picked at startup based on what the CPU
+//	supports; defining FML_NO_SIMD at build time leaves only the scalar ones.
+
+//	Returns a pointer to the first byte in [str, end) which is not a space,
+//	tab, newline or carriage return, or `end` if there is none.
+char const * FmlSkipWhitespace(char const * str, char const * end);
+
+//	Skips over complete and valid UTF-8 multi-byte sequences, and returns a
+//	pointer to the first byte which doesn't start one (an ASCII byte, a stray
+//	continuation byte, an invalid first byte, or the first byte of a sequence
+//	which is broken or cut short by `end`).
+//	Sequences are checked for structure only: the first byte announces how
+//	many continuation bytes (10xxxxxx) follow, up to three.
+char const * FmlSkipUtf8(char const * str, char const * end);
+
+//	Like `FmlSkipUtf8`, but also skips ASCII letters, digits, underscores
+//	and hyphens.
+char const * FmlSkipIdentifier(char const * str, char const * end);
+
+//	Like `FmlSkipUtf8`, but also skips printable ASCII characters other than
+//	double quotes and backslashes; it stops at anything a string literal
+//	can't hold verbatim.
+char const * FmlSkipStringText(char const * str, char const * end);
+
+//	Returns a pointer to the first occurrence of `c` in [str, end), or `end`.
+char const * FmlFindByte(char const * str, char const * end, char c);
@@ -0,0 +1,519 @@
+#include "selector.h"
+#include "utils.char.h"
+#include <string.h>
+#include <errno.h>
+
+typedef struct SelectorParser_s
+{
+	char const * str, * end, * cur;
+	FmlSelector * sel;
+	FmlSelectorError * err;
+} SelectorParser;
+
+static bool Fail(SelectorParser * sp, char const * msg)
+{
+	if (sp->err != NULL)
+	{
+		sp->err->Position = (size_t)(sp->cur - sp->str);
+		sp->err->Message = msg;
+	}
+
+	return false;
+}
+
+static inline char Peek(SelectorParser const * sp)
+{
+	return sp->cur < sp->end ? *(sp->cur) : '\0';
+}
+
+//	Names are spelled like identifiers in documents.
+static inline bool IsNameChar(char c)
+{
+	return FmlCharIs(c, CC_IDENTIFIER) || (unsigned char)c >= 0x80;
+}
+
+static bool SkipSpaces(SelectorParser * sp)
+{
+	char const * const start = sp->cur;
+
+	while (sp->cur < sp->end && FmlCharIs(*(sp->cur), CC_WHITESPACE))
+		++sp->cur;
+
+	return sp->cur != start;
+}
+
+//	Makes room for one more element at the end of an array, doubling it
+//	whenever its size reaches a power of two. The new element is zeroed.
+static void * Append(SelectorParser * sp, void * arr, size_t count, size_t size)
+{
+	void * res = arr;
+
+	if (count == 0 || (count & (count - 1)) == 0)
+		res = FmlArenaGrow(sp->sel->Arena, arr, count * size, (count == 0 ? 1 : count * 2) * size);
+
+	//	The space past the last element is whatever the arena left there.
+	if (res != NULL)
+		memset((char *)res + count * size, 0, size);
+
+	return res;
+}
+
+static char * CopyString(SelectorParser * sp, char const * str, size_t len)
+{
+	char * res = FmlArenaAlloc(sp->sel->Arena, len + 1);
+
+	if (res != NULL)
+	{
+		memcpy(res, str, len);
+		res[len] = '\0';
+	}
+
+	return res;
+}
+
+static bool ParseName(SelectorParser * sp, FmlSelectorName * res)
+{
+	char const * const start = sp->cur;
+
+	while (sp->cur < sp->end && IsNameChar(*(sp->cur)))
+		++sp->cur;
+
+	if (sp->cur == start)
+		return Fail(sp, "Expected a name.");
+
+	res->Length = (size_t)(sp->cur - start);
+
+	if ((res->Name = CopyString(sp, start, res->Length)) == NULL)
+		return Fail(sp, "Out of memory.");
+
+	if (sp->sel->Symbols != NULL
+		&& (res->Symbol = FmlIntern(sp->sel->Symbols, res->Name, res->Length)) == 0)
+		return Fail(sp, "Out of memory.");
+
+	return true;
+}
+
+static bool ParseValue(SelectorParser * sp, FmlSelectorAttribute * at)
+{
+	char * val;
+
+	if (Peek(sp) == '"')
+	{
+		char const * const start = ++sp->cur;
+
+		//	The text can only shrink when unescaped.
+		while (sp->cur < sp->end && *(sp->cur) != '"')
+		{
+			if (*(sp->cur) == '\\' && sp->cur + 1 < sp->end && (unsigned char)(sp->cur[1]) >= 0x80)
+			{
+				++sp->cur;
+				return Fail(sp, "Unexpected UTF-8 multi-byte sequence byte after backslash in string.");
+			}
+
+			sp->cur += *(sp->cur) == '\\' && sp->cur + 1 < sp->end ? 2 : 1;
+		}
+
+		if (sp->cur >= sp->end)
+			return Fail(sp, "Unterminated string.");
+
+		if ((val = FmlArenaAlloc(sp->sel->Arena, (size_t)(sp->cur - start) + 1)) == NULL)
+			return Fail(sp, "Out of memory.");
+
+		size_t len = 0;
+
+		for (char const * c = start; c < sp->cur; ++c)
+			val[len++] = *c == '\\' ? FmlUnescapeChar(*++c) : *c;	//	As in documents.
+
+		val[len] = '\0';
+		at->ValueLength = len;
+		++sp->cur;	//	Skips the closing quote.
+	}
+	else
+	{
+		char const * const start = sp->cur;
+
+		while (sp->cur < sp->end && *(sp->cur) != ']' && *(sp->cur) != '"'
+			&& !FmlCharIs(*(sp->cur), CC_WHITESPACE))
+			++sp->cur;
+
+		if (sp->cur == start)
+			return Fail(sp, "Expected a value.");
+
+		at->ValueLength = (size_t)(sp->cur - start);
+
+		if ((val = CopyString(sp, start, at->ValueLength)) == NULL)
+			return Fail(sp, "Out of memory.");
+
+		//	Only bare words can stand for numbers.
+		char * numEnd;
+
+		errno = 0;
+		at->lValue = strtoll(val, &numEnd, 10);
+		at->IsInteger = errno == 0 && *numEnd == '\0';
+
+		errno = 0;
+		at->dValue = strtod(val, &numEnd);
+		at->IsFloat = errno == 0 && *numEnd == '\0';
+	}
+
+	at->HasValue = true;
+	at->Value = val;
+
+	return true;
+}
+
+static bool ParseCompound(SelectorParser * sp, FmlSelectorStep * step)
+{
+	char const * const start = sp->cur;
+
+	if (Peek(sp) == '*')
+		++sp->cur;
+	else if (IsNameChar(Peek(sp)) && !ParseName(sp, &(step->Name)))
+		return false;
+
+	for (;;)
+	{
+		char const c = Peek(sp);
+
+		if (c == '.')
+		{
+			++sp->cur;
+
+			if ((step->Classes = Append(sp, step->Classes, step->ClassCount, sizeof(FmlSelectorName))) == NULL)
+				return Fail(sp, "Out of memory.");
+
+			if (!ParseName(sp, step->Classes + step->ClassCount++))
+				return false;
+		}
+		else if (c == '#')
+		{
+			FmlSelectorName id = { 0 };
+
+			if (step->Id != NULL)
+				return Fail(sp, "A node only has one ID.");
+
+			++sp->cur;
+
+			if (!ParseName(sp, &id))
+				return false;
+
+			step->Id = id.Name;
+			step->IdLength = id.Length;
+		}
+		else if (c == '[')
+		{
+			++sp->cur;
+			SkipSpaces(sp);
+
+			if ((step->Attributes = Append(sp, step->Attributes, step->AttributeCount, sizeof(FmlSelectorAttribute))) == NULL)
+				return Fail(sp, "Out of memory.");
+
+			FmlSelectorAttribute * const at = step->Attributes + step->AttributeCount++;
+
+			if (!ParseName(sp, &(at->Key)))
+				return false;
+
+			SkipSpaces(sp);
+
+			if (Peek(sp) == '=')
+			{
+				++sp->cur;
+				SkipSpaces(sp);
+
+				if (!ParseValue(sp, at))
+					return false;
+
+				SkipSpaces(sp);
+			}
+
+			if (Peek(sp) != ']')
+				return Fail(sp, "Expected closing bracket.");
+
+			++sp->cur;
+		}
+		else
+			break;
+	}
+
+	if (sp->cur == start)
+		return Fail(sp, "Expected a selector.");
+
+	return true;
+}
+
+static bool ParseComplex(SelectorParser * sp, FmlComplexSelector * cs)
+{
+	enum SELECTOR_COMBINATORS comb = SC_DESCENDANT;
+
+	for (;;)
+	{
+		if ((cs->Steps = Append(sp, cs->Steps, cs->StepCount, sizeof(FmlSelectorStep))) == NULL)
+			return Fail(sp, "Out of memory.");
+
+		FmlSelectorStep * const step = cs->Steps + cs->StepCount++;
+		step->Combinator = comb;
+
+		if (!ParseCompound(sp, step))
+			return false;
+
+		bool const spaced = SkipSpaces(sp);
+
+		if (sp->cur == sp->end || *(sp->cur) == ',')
+			return true;
+
+		if (*(sp->cur) == '>')
+		{
+			++sp->cur;
+			SkipSpaces(sp);
+			comb = SC_CHILD;
+		}
+		else if (spaced)
+			comb = SC_DESCENDANT;
+		else
+			return Fail(sp, "Unexpected character.");
+	}
+}
+
+FmlSelector * FmlCompileSelector(char const * str, size_t len, FmlSymbolTable * st, FmlSelectorError * err)
+{
+	FmlSelector * sel = calloc(1, sizeof(FmlSelector));
+
+	if (sel == NULL || (sel->Arena = FmlCreateArena(1024)) == NULL)
+	{
+		free(sel);
+
+		if (err != NULL)
+			*err = (FmlSelectorError){ 0, "Out of memory." };
+
+		return NULL;
+	}
+
+	sel->Symbols = st;
+
+	SelectorParser sp = { str, str + len, str, sel, err };
+
+	SkipSpaces(&sp);
+
+	for (;;)
+	{
+		if ((sel->Alternatives = Append(&sp, sel->Alternatives, sel->AlternativeCount, sizeof(FmlComplexSelector))) == NULL)
+		{
+			Fail(&sp, "Out of memory.");
+			break;
+		}
+
+		if (!ParseComplex(&sp, sel->Alternatives + sel->AlternativeCount++))
+			break;
+
+		if (sp.cur == sp.end)
+			return sel;
+
+		++sp.cur;	//	Skips the comma.
+		SkipSpaces(&sp);
+	}
+
+	FmlFreeSelector(sel);
+
+	return NULL;
+}
+
+void FmlFreeSelector(FmlSelector * sel)
+{
+	FmlFreeArena(sel->Arena);
+	free(sel);
+}
+
+static inline bool NameIs(FmlSelectorName const * sn, bool useSymbols, FmlSymbol sym, char const * name, size_t len)
+{
+	if (useSymbols && sym != 0)
+		return sym == sn->Symbol;
+
+	return sn->Length == len && memcmp(sn->Name, name, len) == 0;
+}
+
+static bool ValueMatches(FmlSelectorAttribute const * sa, Attribute const * at)
+{
+	switch (at->ValueType)
+	{
+	case AVT_STRING:
+	case AVT_IDENTIFIER:
+		return sa->ValueLength == at->sLength && memcmp(sa->Value, at->sValue, at->sLength) == 0;
+
+	case AVT_INTEGER:
+		return sa->IsInteger && sa->lValue == at->lValue;
+
+	case AVT_FLOAT:
+		return sa->IsFloat && sa->dValue == at->dValue;
+
+	default:
+		return false;
+	}
+}
+
+static bool MatchStep(FmlSelectorStep const * step, bool useSymbols, Node const * n)
+{
+	if (step->Name.Name != NULL && !NameIs(&(step->Name), useSymbols, n->NameSymbol, n->Name, n->NameLength))
+		return false;
+
+	if (step->Id != NULL
+		&& (n->Id == NULL || n->IdLength != step->IdLength || memcmp(n->Id, step->Id, step->IdLength) != 0))
+		return false;
+
+	for (size_t i = 0; i < step->ClassCount; ++i)
+	{
+		Class const * cl = n->Classes;
+
+		while (cl != NULL && !NameIs(step->Classes + i, useSymbols, cl->NameSymbol, cl->Name, cl->NameLength))
+			cl = cl->Next;
+
+		if (cl == NULL)
+			return false;
+	}
+
+	for (size_t i = 0; i < step->AttributeCount; ++i)
+	{
+		FmlSelectorAttribute const * const sa = step->Attributes + i;
+		Attribute const * at = n->Attributes;
+
+		while (at != NULL
+			&& !(NameIs(&(sa->Key), useSymbols, at->KeySymbol, at->Key, at->KeyLength)
+				&& (!sa->HasValue || ValueMatches(sa, at))))
+			at = at->Next;
+
+		if (at == NULL)
+			return false;
+	}
+
+	return true;
+}
+
+//	Steps are matched from right to left, going up the tree; a descendant
+//	combinator tries every ancestor until the rest of the chain matches.
+static bool MatchFrom(FmlComplexSelector const * cs, size_t i, bool useSymbols, Node const * n)
+{
+	if (!MatchStep(cs->Steps + i, useSymbols, n))
+		return false;
+
+	if (i == 0)
+		return true;
+
+	if (cs->Steps[i].Combinator == SC_CHILD)
+		return n->Parent != NULL && MatchFrom(cs, i - 1, useSymbols, n->Parent);
+
+	for (Node const * anc = n->Parent; anc != NULL; anc = anc->Parent)
+		if (MatchFrom(cs, i - 1, useSymbols, anc))
+			return true;
+
+	return false;
+}
+
+static inline bool UseSymbols(FmlSelector const * sel, ParserState const * p)
+{
+	return sel->Symbols != NULL && sel->Symbols == p->Symbols;
+}
+
+bool FmlMatchSelector(FmlSelector const * sel, ParserState const * p, Node const * n)
+{
+	bool const useSymbols = UseSymbols(sel, p);
+
+	for (size_t i = 0; i < sel->AlternativeCount; ++i)
+		if (MatchFrom(sel->Alternatives + i, sel->Alternatives[i].StepCount - 1, useSymbols, n))
+			return true;
+
+	return false;
+}
+
+//	Finds the nodes with all the classes of a step, through the index.
+static bool FindByClasses(FmlSelectorStep const * step, bool useSymbols, ParserState * p, FmlNodeList * res)
+{
+	FmlSymbol * const syms = malloc(step->ClassCount * sizeof(FmlSymbol));
+
+	if (syms == NULL)
+		return false;
+
+	bool ok = true;
+
+	res->Count = 0;
+
+	for (size_t i = 0; i < step->ClassCount; ++i)
+	{
+		FmlSelectorName const * const cl = step->Classes + i;
+
+		//	A class which was never interned is on no node.
+		if ((syms[i] = useSymbols ? cl->Symbol : FmlFindSymbol(p->Symbols, cl->Name, cl->Length)) == 0)
+			goto end;
+	}
+
+	ok = FmlIntersectClasses(p, syms, step->ClassCount, res);
+
+end:
+	free(syms);
+
+	return ok;
+}
+
+static int CompareNodes(void const * a, void const * b)
+{
+	size_t const sa = (*(Node * const *)a)->Start, sb = (*(Node * const *)b)->Start;
+
+	return (sa > sb) - (sa < sb);
+}
+
+bool FmlSelect(FmlSelector const * sel, ParserState * p, FmlNodeList * res)
+{
+	bool const useSymbols = UseSymbols(sel, p);
+	FmlNodeList candidates = { 0 };
+	bool ok = true;
+
+	res->Count = 0;
+
+	for (size_t i = 0; ok && i < sel->AlternativeCount; ++i)
+	{
+		FmlComplexSelector const * const cs = sel->Alternatives + i;
+		size_t const last = cs->StepCount - 1;
+		FmlSelectorStep const * const step = cs->Steps + last;
+
+		//	With duplicate IDs around, the index doesn't know every node
+		//	with an ID.
+		if (step->Id != NULL && p->Ids != NULL && p->Ids->Duplicates == 0)
+		{
+			Node * const n = FmlFindInIdIndex(p->Ids, step->Id, step->IdLength);
+
+			if (n != NULL && MatchFrom(cs, last, useSymbols, n))
+				ok = FmlAddToNodeList(res, n);
+		}
+		else if (step->ClassCount > 0 && p->Classes != NULL)
+		{
+			if (!(ok = FindByClasses(step, useSymbols, p, &candidates)))
+				break;
+
+			for (size_t j = 0; ok && j < candidates.Count; ++j)
+				if (MatchFrom(cs, last, useSymbols, candidates.Nodes[j]))
+					ok = FmlAddToNodeList(res, candidates.Nodes[j]);
+		}
+		else
+		{
+			for (Node * n = p->Nodes; ok && n != NULL; n = FmlNextNode(n))
+				if (MatchFrom(cs, last, useSymbols, n))
+					ok = FmlAddToNodeList(res, n);
+		}
+	}
+
+	FmlClearNodeList(&candidates);
+
+	//	The matches of every alternative are merged.
+	if (ok && sel->AlternativeCount > 1 && res->Count > 1)
+	{
+		size_t kept = 1;
+
+		qsort(res->Nodes, res->Count, sizeof(Node *), CompareNodes);
+
+		for (size_t i = 1; i < res->Count; ++i)
+			if (res->Nodes[i] != res->Nodes[kept - 1])
+				res->Nodes[kept++] = res->Nodes[i];
+
+		res->Count = kept;
+	}
+
+	return ok;
+}
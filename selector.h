@@ -0,0 +1,101 @@
+#pragma once
+
+#include "index.h"
+
+//	Selectors pick nodes out of a document, like CSS selectors do:
+//
+//		window > menu-bar menu-item.primary#open[text="File"], label
+//
+//	A compound selector is a node name (or `*`, or nothing, for any node)
+//	followed by any number of `.class`, `#id`, `[key]` and `[key=value]`.
+//	Compounds are chained by whitespace (the node on the right has to be a
+//	descendant of one matching the left) or `>` (a child), and whole
+//	selectors are separated by commas, matching nodes which match any.
+//	Values are strings in double quotes, with the same escape sequences as
+//	in documents, or bare words. A `[key=value]` matches string and
+//	identifier values by their text, and integer and float values by the
+//	number the word spells.
+
+typedef struct FmlSelectorName_s
+{
+	char const * Name;
+	size_t Length;
+	FmlSymbol Symbol;	//	In the table the selector was compiled with, if any.
+} FmlSelectorName;
+
+typedef struct FmlSelectorAttribute_s
+{
+	FmlSelectorName Key;
+
+	bool HasValue;
+	char const * Value;
+	size_t ValueLength;
+
+	//	Whether the value spells out a number, and which.
+	bool IsInteger, IsFloat;
+	long long int lValue;
+	double dValue;
+} FmlSelectorAttribute;
+
+enum SELECTOR_COMBINATORS
+{
+	SC_DESCENDANT, SC_CHILD
+};
+
+typedef struct FmlSelectorStep_s
+{
+	//	How the node relates to the one matching the previous step.
+	enum SELECTOR_COMBINATORS Combinator;
+
+	FmlSelectorName Name;	//	Null for any node.
+
+	char const * Id;		//	Null for any ID.
+	size_t IdLength;
+
+	FmlSelectorName * Classes;
+	size_t ClassCount;
+
+	FmlSelectorAttribute * Attributes;
+	size_t AttributeCount;
+} FmlSelectorStep;
+
+//	A chain of compound selectors; the last step is the one that matches
+//	the nodes which are selected.
+typedef struct FmlComplexSelector_s
+{
+	FmlSelectorStep * Steps;
+	size_t StepCount;
+} FmlComplexSelector;
+
+typedef struct FmlSelector_s
+{
+	FmlComplexSelector * Alternatives;
+	size_t AlternativeCount;
+
+	FmlSymbolTable * Symbols;
+	FmlArena * Arena;	//	Everything above lives here.
+} FmlSelector;
+
+typedef struct FmlSelectorError_s
+{
+	size_t Position;
+	char const * Message;
+} FmlSelectorError;
+
+//	Compiles a selector; returns null and fills in `err` (if given) when it
+//	is malformed or there's no memory.
+//	When a symbol table is given, the names in the selector are interned in
+//	it, and documents parsed with the same table have their names compared
+//	as integers.
+FmlSelector * FmlCompileSelector(char const * str, size_t len, FmlSymbolTable * st, FmlSelectorError * err);
+void FmlFreeSelector(FmlSelector * sel);
+
+//	Tells whether a node matches; its ancestors are looked at through the
+//	parent links.
+bool FmlMatchSelector(FmlSelector const * sel, ParserState const * p, Node const * n);
+
+//	Fills `res` with the nodes of the document which match, in document
+//	order. The ID and class indexes are used to find candidates if they've
+//	been built; otherwise the whole tree is searched.
+//	Returns false if there's no memory for it.
+bool FmlSelect(FmlSelector const * sel, ParserState * p, FmlNodeList * res);
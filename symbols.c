@@ -0,0 +1,161 @@
+#include "symbols.h"
+#include <string.h>
+
+FmlSymbolTable * FmlCreateSymbolTable(void)
+{
+	FmlSymbolTable * st = calloc(1, sizeof(FmlSymbolTable));
+
+	if (st == NULL)
+		return NULL;
+
+	if ((st->Arena = FmlCreateArena(0)) == NULL)
+	{
+		free(st);
+		return NULL;
+	}
+
+	return st;
+}
+
+void FmlFreeSymbolTable(FmlSymbolTable * st)
+{
+	FmlFreeArena(st->Arena);
+	free(st->Symbols);
+	free(st->Slots);
+	free(st);
+}
+
+//	Names are mostly short, so they're hashed a word at a time with a
+//	multiply-and-fold mix, which is plenty for a table keyed on them.
+uint32_t FmlHashName(char const * str, size_t len)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ull ^ len, w;
+
+	for (/* nothing */; len >= 8; str += 8, len -= 8)
+	{
+		memcpy(&w, str, 8);
+		h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+		h ^= h >> 32;
+	}
+
+	//	The tail is read with fixed-size loads, overlapping where needed,
+	//	because a variable-length copy ends up as a call.
+	if (len >= 4)
+	{
+		uint32_t lo, hi;
+		memcpy(&lo, str, 4);
+		memcpy(&hi, str + len - 4, 4);
+		w = (uint64_t)hi << 32 | lo;
+	}
+	else if (len > 0)
+		w = (uint64_t)(unsigned char)str[0] << 16
+		  | (uint64_t)(unsigned char)str[len / 2] << 8
+		  | (unsigned char)str[len - 1];
+
+	if (len > 0)
+	{
+		h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+		h ^= h >> 32;
+	}
+
+	h *= 0xC4CEB9FE1A85EC53ull;
+
+	return (uint32_t)(h >> 32);
+}
+
+//	Returns the slot which holds the name, or the empty one where it'd go.
+static uint32_t * FindSlot(FmlSymbolTable const * st, char const * str, size_t len, uint32_t hash)
+{
+	size_t const mask = st->SlotCount - 1;
+
+	for (size_t i = hash & mask; /* nothing */; i = (i + 1) & mask)
+	{
+		uint32_t * const slot = st->Slots + i;
+
+		if (*slot == 0)
+			return slot;
+
+		FmlSymbolInfo const * const info = st->Symbols + *slot;
+
+		if (info->Hash == hash && info->Length == len && memcmp(info->Name, str, len) == 0)
+			return slot;
+	}
+}
+
+//	Keeps the table at most half full.
+static bool GrowSlots(FmlSymbolTable * st)
+{
+	size_t const newCount = st->SlotCount < 256 ? 256 : st->SlotCount * 2;
+	uint32_t * slots = calloc(newCount, sizeof(uint32_t));
+
+	if (slots == NULL)
+		return false;
+
+	free(st->Slots);
+	st->Slots = slots;
+	st->SlotCount = newCount;
+
+	for (size_t sym = 1; sym < st->Count; ++sym)
+	{
+		size_t i = st->Symbols[sym].Hash & (newCount - 1);
+
+		while (slots[i] != 0)
+			i = (i + 1) & (newCount - 1);
+
+		slots[i] = (uint32_t)sym;
+	}
+
+	return true;
+}
+
+FmlSymbol FmlIntern(FmlSymbolTable * st, char const * str, size_t len)
+{
+	uint32_t const hash = FmlHashName(str, len);
+
+	if (len > UINT32_MAX || ((st->Count + 1) * 2 > st->SlotCount && !GrowSlots(st)))
+		return 0;
+
+	uint32_t * const slot = FindSlot(st, str, len, hash);
+
+	if (*slot != 0)
+		return *slot;
+
+	if (st->Count == 0)
+		st->Count = 1;	//	Symbol 0 stands for none.
+
+	if (st->Count >= st->Capacity)
+	{
+		size_t const newCap = st->Capacity < 256 ? 256 : st->Capacity * 2;
+		FmlSymbolInfo * symbols = newCap <= UINT32_MAX
+			? realloc(st->Symbols, newCap * sizeof(FmlSymbolInfo))
+			: NULL;
+
+		if (symbols == NULL)
+			return 0;
+
+		st->Symbols = symbols;
+		st->Capacity = newCap;
+	}
+
+	char * name = FmlArenaAlloc(st->Arena, len + 1);
+
+	if (name == NULL)
+		return 0;
+
+	memcpy(name, str, len);
+	name[len] = '\0';
+
+	FmlSymbol const sym = (FmlSymbol)(st->Count++);
+	st->Symbols[sym] = (FmlSymbolInfo){ name, (uint32_t)len, hash };
+	*slot = sym;
+
+	return sym;
+}
+
+FmlSymbol FmlFindSymbol(FmlSymbolTable const * st, char const * str, size_t len)
+{
+	if (st->SlotCount == 0)
+		return 0;
+
+	return *FindSlot(st, str, len, FmlHashName(str, len));
+}
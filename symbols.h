@@ -0,0 +1,46 @@
+#pragma once
+
+#include "arena.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+//	Symbols are small numbers standing for distinct names, so names can be
+//	compared and hashed as integers. 0 is never a symbol.
+typedef uint32_t FmlSymbol;
+
+typedef struct FmlSymbolInfo_s
+{
+	char const * Name;	//	Null-terminated.
+	uint32_t Length;
+	uint32_t Hash;
+} FmlSymbolInfo;
+
+//	Interns names; a table can be shared by any number of documents, as long
+//	as they're parsed one at a time.
+typedef struct FmlSymbolTable_s
+{
+	FmlSymbolInfo * Symbols;	//	Indexed by symbol; the first one is unused.
+	size_t Count, Capacity;
+
+	uint32_t * Slots;	//	Open addressing over the hashes; 0 is an empty slot.
+	size_t SlotCount;	//	A power of two.
+
+	FmlArena * Arena;	//	Holds the names.
+} FmlSymbolTable;
+
+FmlSymbolTable * FmlCreateSymbolTable(void);
+void FmlFreeSymbolTable(FmlSymbolTable * st);
+
+uint32_t FmlHashName(char const * str, size_t len);
+
+//	Returns the symbol of the given name, adding it if it's new, or 0 if
+//	there's no memory for that.
+FmlSymbol FmlIntern(FmlSymbolTable * st, char const * str, size_t len);
+
+//	Returns the symbol of the given name, or 0 if it was never interned.
+FmlSymbol FmlFindSymbol(FmlSymbolTable const * st, char const * str, size_t len);
+
+static inline FmlSymbolInfo const * FmlGetSymbol(FmlSymbolTable const * st, FmlSymbol sym)
+{
+	return st->Symbols + sym;
+}
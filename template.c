@@ -0,0 +1,569 @@
+#include "template.h"
+#include "index.h"
+#include <string.h>
+
+typedef struct Template_s
+{
+	Node * Definition;
+	char const * Name;
+	size_t NameLength;
+	uint32_t Hash;
+
+	Attribute const * Parameters;	//	The attributes after the name.
+	size_t ParameterCount;
+
+	bool expanding;
+} Template;
+
+//	The expansion of a template for a set of arguments.
+typedef struct Expansion_s
+{
+	uint32_t Hash;
+	Template const * Template;
+	Attribute const * * Arguments;	//	One per parameter; null when missing.
+
+	Node * Children, * LastChild;
+	size_t ChildrenCount;
+
+	struct Expansion_s * Next;	//	In the same bucket.
+} Expansion;
+
+typedef struct Expander_s
+{
+	ParserState * p;
+
+	Template * templates;
+	size_t templateCount, templateCapacity;
+	uint32_t * templateSlots;	//	Template index plus one, by name hash.
+	size_t templateSlotCount;
+
+	Expansion * * buckets;
+	size_t bucketCount, expansionCount;
+
+	FmlArena * scratch;	//	Expansions and arguments, dropped at the end.
+	bool ok;			//	False once out of memory.
+} Expander;
+
+static bool IsNamed(Node const * n, char const * name, size_t len)
+{
+	return n->NameLength == len && memcmp(n->Name, name, len) == 0;
+}
+
+static void * OutOfMemory(Expander * e)
+{
+	e->ok = false;
+
+	return NULL;
+}
+
+//	Copies a node or attribute into the document's arena.
+static void * Copy(Expander * e, void const * src, size_t size)
+{
+	void * res = FmlArenaAlloc(e->p->Arena, size);
+
+	if (res == NULL)
+		return OutOfMemory(e);
+
+	return memcpy(res, src, size);
+}
+
+static Template * FindTemplate(Expander const * e, char const * name, size_t len)
+{
+	if (e->templateSlotCount == 0)
+		return NULL;
+
+	uint32_t const hash = FmlHashName(name, len);
+	size_t const mask = e->templateSlotCount - 1;
+
+	for (size_t i = hash & mask; e->templateSlots[i] != 0; i = (i + 1) & mask)
+	{
+		Template * const t = e->templates + e->templateSlots[i] - 1;
+
+		if (t->Hash == hash && t->NameLength == len && memcmp(t->Name, name, len) == 0)
+			return t;
+	}
+
+	return NULL;
+}
+
+//	Keeps the table at most half full.
+static bool AddTemplate(Expander * e, Template const * t)
+{
+	if (e->templateCount == e->templateCapacity)
+	{
+		size_t const newCap = e->templateCapacity < 16 ? 16 : e->templateCapacity * 2;
+		Template * templates = realloc(e->templates, newCap * sizeof(Template));
+
+		if (templates == NULL)
+			return false;
+
+		e->templates = templates;
+		e->templateCapacity = newCap;
+	}
+
+	e->templates[e->templateCount++] = *t;
+
+	if (e->templateCount * 2 > e->templateSlotCount)
+	{
+		size_t const newCount = e->templateSlotCount < 32 ? 32 : e->templateSlotCount * 2;
+		uint32_t * slots = calloc(newCount, sizeof(uint32_t));
+
+		if (slots == NULL)
+			return false;
+
+		free(e->templateSlots);
+		e->templateSlots = slots;
+		e->templateSlotCount = newCount;
+
+		//	Every template goes in, the new one included.
+		for (size_t i = 0; i < e->templateCount; ++i)
+		{
+			size_t j = e->templates[i].Hash & (newCount - 1);
+
+			while (slots[j] != 0)
+				j = (j + 1) & (newCount - 1);
+
+			slots[j] = (uint32_t)(i + 1);
+		}
+	}
+	else
+	{
+		size_t j = t->Hash & (e->templateSlotCount - 1);
+
+		while (e->templateSlots[j] != 0)
+			j = (j + 1) & (e->templateSlotCount - 1);
+
+		e->templateSlots[j] = (uint32_t)(e->templateCount);
+	}
+
+	return true;
+}
+
+//	Moves the top-level templates out of the document.
+static bool CollectTemplates(Expander * e)
+{
+	ParserState * const p = e->p;
+	Node * * link = &(p->Nodes), * * tplLink = &(p->Templates), * last = NULL;
+
+	while (*tplLink != NULL)
+		tplLink = &((*tplLink)->Next);
+
+	for (Node * n = p->Nodes, * next; n != NULL; n = next)
+	{
+		next = n->Next;
+
+		if (!IsNamed(n, "template", 8))
+		{
+			link = &(n->Next);
+			last = n;
+			continue;
+		}
+
+		*link = next;
+		*tplLink = n;
+		tplLink = &(n->Next);
+		n->Next = NULL;
+
+		Attribute const * const name = n->Attributes;
+
+		if (name == NULL || name->ValueType != AVT_NONE)
+		{
+			p->ErrorSink(p, n->Start, 0, "Template has no name.");
+			continue;
+		}
+
+		if (FindTemplate(e, name->Key, name->KeyLength) != NULL)
+		{
+			p->ErrorSink(p, name->Start, name->End - name->Start, "Duplicate template.");
+			continue;
+		}
+
+		Template t = {
+			.Definition = n,
+			.Name = name->Key,
+			.NameLength = name->KeyLength,
+			.Hash = FmlHashName(name->Key, name->KeyLength),
+			.Parameters = name->Next,
+		};
+
+		for (Attribute const * at = name->Next; at != NULL; at = at->Next)
+			++t.ParameterCount;
+
+		if (!AddTemplate(e, &t))
+			return false;
+	}
+
+	p->LastNode = last;
+
+	return true;
+}
+
+static bool ValuesEqual(Attribute const * a, Attribute const * b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+
+	if (a->ValueType != b->ValueType)
+		return false;
+
+	switch (a->ValueType)
+	{
+	case AVT_STRING:
+	case AVT_IDENTIFIER:
+	case AVT_REFERENCE:
+		return a->sLength == b->sLength && memcmp(a->sValue, b->sValue, a->sLength) == 0;
+
+	case AVT_INTEGER:
+		return a->lValue == b->lValue;
+
+	case AVT_FLOAT:
+		return memcmp(&(a->dValue), &(b->dValue), sizeof(double)) == 0;
+
+	default:
+		return true;
+	}
+}
+
+static uint32_t HashArguments(Template const * t, Attribute const * const * args)
+{
+	uint32_t h = t->Hash;
+
+	for (size_t i = 0; i < t->ParameterCount; ++i)
+	{
+		Attribute const * const a = args[i];
+		uint32_t v = a == NULL ? 0 : (uint32_t)(a->ValueType) + 1;
+
+		if (a != NULL)
+			switch (a->ValueType)
+			{
+			case AVT_STRING:
+			case AVT_IDENTIFIER:
+			case AVT_REFERENCE:
+				v ^= FmlHashName(a->sValue, a->sLength);
+				break;
+
+			case AVT_INTEGER:
+			case AVT_FLOAT:
+				//	Both are 8 bytes, and equal values have equal bits.
+				v ^= FmlHashName((char const *)&(a->lValue), sizeof(a->lValue));
+				break;
+
+			default:
+				break;
+			}
+
+		h = (h ^ v) * 0x9E3779B1u;
+	}
+
+	return h;
+}
+
+//	Picks the value of every parameter: the instance's attribute with its
+//	name, or else the default. Parameters with neither are reported.
+static Attribute const * * ResolveArguments(Expander * e, Template const * t, Node const * instance)
+{
+	Attribute const * * args = FmlArenaAlloc(e->scratch, (t->ParameterCount + 1) * sizeof(Attribute const *));
+
+	if (args == NULL)
+		return OutOfMemory(e);
+
+	size_t i = 0;
+
+	for (Attribute const * param = t->Parameters; param != NULL; param = param->Next, ++i)
+	{
+		Attribute const * at = instance->Attributes;
+
+		while (at != NULL && !(at->KeyLength == param->KeyLength && memcmp(at->Key, param->Key, at->KeyLength) == 0))
+			at = at->Next;
+
+		if (at == NULL && param->ValueType != AVT_NONE)
+			at = param;
+
+		if (at == NULL)
+			e->p->ErrorSink(e->p, instance->Start, instance->End - instance->Start, "Missing template argument.");
+
+		args[i] = at;
+	}
+
+	return args;
+}
+
+//	Returns the index of the parameter an attribute refers to, or -1.
+static long ParameterOf(Template const * t, Attribute const * at)
+{
+	if (at->ValueType != AVT_REFERENCE || at->sValue == NULL)
+		return -1;
+
+	long i = 0;
+
+	for (Attribute const * param = t->Parameters; param != NULL; param = param->Next, ++i)
+		if (param->KeyLength == at->sLength && memcmp(param->Key, at->sValue, at->sLength) == 0)
+			return i;
+
+	return -1;
+}
+
+//	Returns the attributes with the references to parameters replaced, or
+//	the same list if there are none.
+static Attribute * SubstituteAttributes(Expander * e, Template const * t, Attribute const * const * args, Attribute * list)
+{
+	Attribute * at = list;
+
+	while (at != NULL && ParameterOf(t, at) < 0)
+		at = at->Next;
+
+	if (at == NULL)
+		return list;
+
+	Attribute * res = NULL, * * link = &res;
+
+	for (at = list; at != NULL; at = at->Next)
+	{
+		Attribute * const cp = Copy(e, at, sizeof(Attribute));
+
+		if (cp == NULL)
+			return list;
+
+		long const param = ParameterOf(t, at);
+
+		if (param >= 0)
+		{
+			Attribute const * const arg = args[param];
+
+			cp->ValueType = arg != NULL ? arg->ValueType : AVT_NONE;
+
+			//	The string members span the whole value union.
+			cp->sValue = arg != NULL ? arg->sValue : NULL;
+			cp->sLength = arg != NULL ? arg->sLength : 0;
+		}
+
+		*link = cp;
+		link = &(cp->Next);
+	}
+
+	*link = NULL;
+
+	return res;
+}
+
+static Expansion const * Expand(Expander * e, Template * t, Attribute const * * args, Node const * instance);
+
+//	Makes an instance's body its expansion.
+static void ExpandInstance(Expander * e, Template * t, Node * instance)
+{
+	if (instance->BodyType != NBT_NONE)
+	{
+		e->p->ErrorSink(e->p, instance->Start, 0, "Template instances can't have a body.");
+		return;
+	}
+
+	Attribute const * * const args = ResolveArguments(e, t, instance);
+
+	if (args == NULL)
+		return;
+
+	Expansion const * const ex = Expand(e, t, args, instance);
+
+	if (ex != NULL)
+	{
+		instance->BodyType = NBT_EXPANDED;
+		instance->Children = ex->Children;
+		instance->LastChild = ex->LastChild;
+		instance->ChildrenCount = ex->ChildrenCount;
+	}
+}
+
+//	Expands a list of siblings from a template's body. Lists in which nothing
+//	changes are kept as they are; otherwise every node in them is copied,
+//	but the unchanged children and attributes of the copies are shared.
+//	Returns whether the list was copied.
+static bool ExpandList(Expander * e, Template const * t, Attribute const * const * args, Node * list, Node * * head, Node * * last, size_t * count)
+{
+	Node * tail = NULL;
+	bool copying = false;
+
+	*head = list;
+	*last = NULL;
+	*count = 0;
+
+	for (Node * n = list; n != NULL && e->ok; n = n->Next)
+	{
+		Attribute * const attrs = SubstituteAttributes(e, t, args, n->Attributes);
+		Template * const inst = FindTemplate(e, n->Name, n->NameLength);
+		Node * kids = NULL, * lastKid = NULL;
+		size_t kidCount = 0;
+		bool const kidsChanged = n->BodyType == NBT_CHILDREN
+			&& ExpandList(e, t, args, n->Children, &kids, &lastKid, &kidCount);
+
+		if (!copying && (attrs != n->Attributes || inst != NULL || kidsChanged))
+		{
+			//	The nodes before this one were unchanged; they're copied now.
+			copying = true;
+			*head = NULL;
+
+			for (Node * m = list; m != n; m = m->Next)
+			{
+				Node * const cp = Copy(e, m, sizeof(Node));
+
+				if (cp == NULL)
+					return false;
+
+				cp->Next = NULL;
+
+				if (tail == NULL)
+					*head = cp;
+				else
+					tail->Next = cp;
+
+				tail = cp;
+			}
+		}
+
+		++*count;
+
+		if (!copying)
+		{
+			*last = n;
+			continue;
+		}
+
+		Node * const cp = Copy(e, n, sizeof(Node));
+
+		if (cp == NULL)
+			return false;
+
+		cp->Next = cp->Parent = NULL;
+		cp->Attributes = attrs;
+
+		if (kidsChanged)
+		{
+			cp->Children = kids;
+			cp->LastChild = lastKid;
+			cp->ChildrenCount = kidCount;
+
+			for (Node * kid = kids; kid != NULL; kid = kid->Next)
+				kid->Parent = cp;
+		}
+
+		if (inst != NULL)
+			ExpandInstance(e, inst, cp);
+
+		if (tail == NULL)
+			*head = cp;
+		else
+			tail->Next = cp;
+
+		tail = *last = cp;
+	}
+
+	return copying;
+}
+
+static Expansion const * Expand(Expander * e, Template * t, Attribute const * * args, Node const * instance)
+{
+	uint32_t const hash = HashArguments(t, args);
+
+	if (e->bucketCount > 0)
+		for (Expansion * ex = e->buckets[hash & (e->bucketCount - 1)]; ex != NULL; ex = ex->Next)
+		{
+			if (ex->Hash != hash || ex->Template != t)
+				continue;
+
+			size_t i = 0;
+
+			while (i < t->ParameterCount && ValuesEqual(ex->Arguments[i], args[i]))
+				++i;
+
+			if (i == t->ParameterCount)
+				return ex;
+		}
+
+	if (t->expanding)
+	{
+		e->p->ErrorSink(e->p, instance->Start, 0, "Recursive template.");
+		return NULL;
+	}
+
+	Expansion * ex = FmlArenaAlloc(e->scratch, sizeof(Expansion));
+
+	if (ex == NULL)
+		return OutOfMemory(e);
+
+	*ex = (Expansion){ .Hash = hash, .Template = t, .Arguments = args };
+
+	t->expanding = true;
+
+	if (t->Definition->BodyType == NBT_CHILDREN)
+		(void)ExpandList(e, t, args, t->Definition->Children, &(ex->Children), &(ex->LastChild), &(ex->ChildrenCount));
+
+	t->expanding = false;
+
+	if (!e->ok)
+		return NULL;
+
+	//	The chains are kept short.
+	if (e->expansionCount >= e->bucketCount)
+	{
+		size_t const newCount = e->bucketCount < 64 ? 64 : e->bucketCount * 2;
+		Expansion * * buckets = calloc(newCount, sizeof(Expansion *));
+
+		if (buckets == NULL)
+			return OutOfMemory(e);
+
+		for (size_t i = 0; i < e->bucketCount; ++i)
+			for (Expansion * old = e->buckets[i], * next; old != NULL; old = next)
+			{
+				next = old->Next;
+				old->Next = buckets[old->Hash & (newCount - 1)];
+				buckets[old->Hash & (newCount - 1)] = old;
+			}
+
+		free(e->buckets);
+		e->buckets = buckets;
+		e->bucketCount = newCount;
+	}
+
+	ex->Next = e->buckets[hash & (e->bucketCount - 1)];
+	e->buckets[hash & (e->bucketCount - 1)] = ex;
+	++e->expansionCount;
+
+	return ex;
+}
+
+bool FmlExpandTemplates(ParserState * p)
+{
+	Expander e = { .p = p, .ok = true };
+	FmlNodeList instances = { 0 };
+
+	if ((e.scratch = FmlCreateArena(0)) == NULL)
+		return false;
+
+	//	Instances may be anywhere, and templates are expanded in full.
+	FmlLoadAll(p);
+
+	e.ok = CollectTemplates(&e);
+
+	//	Instances are gathered first, as expanding them changes the tree.
+	if (e.ok && e.templateCount > 0)
+		for (Node * n = p->Nodes; e.ok && n != NULL; n = FmlNextNode(n))
+			if (FindTemplate(&e, n->Name, n->NameLength) != NULL)
+				e.ok = FmlAddToNodeList(&instances, n);
+
+	for (size_t i = 0; e.ok && i < instances.Count; ++i)
+	{
+		Node * const n = instances.Nodes[i];
+
+		ExpandInstance(&e, FindTemplate(&e, n->Name, n->NameLength), n);
+	}
+
+	//	The indexes still have the templates, and the instances' old bodies.
+	FmlDropIndexes(p);
+
+	FmlClearNodeList(&instances);
+	FmlFreeArena(e.scratch);
+	free(e.buckets);
+	free(e.templateSlots);
+	free(e.templates);
+
+	return e.ok;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "parser.h"
+
+//	Templates are top-level nodes named `template`:
+//
+//		template named-text-input name value=none btn="OK" { ... text=$name ... }
+//
+//	The first attribute, which has no value, names the template; the others
+//	are its parameters, and their values are the defaults. Nodes named after
+//	a template are its instances: their attributes are the arguments, and
+//	their bodies are made of the template's children, where every value that
+//	refers to a parameter is replaced by the argument (or the default).
+//
+//	Instances with the same arguments share one expansion, and the parts of
+//	a template which don't depend on its parameters are shared by all of its
+//	expansions, so an expanded document is a graph rather than a tree.
+//	Expansions hang off NBT_EXPANDED bodies, which aren't entered by
+//	`FmlNextNode`, the indexes or selectors; the Parent links inside them
+//	aren't meaningful.
+
+//	Takes the templates out of the document, into `p->Templates`, and gives
+//	every instance its expansion. Problems are reported to the parser's
+//	error sink. The indexes are dropped, to be built again on demand.
+//	Returns false if there's no memory to finish.
+bool FmlExpandTemplates(ParserState * p);
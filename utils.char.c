@@ -0,0 +1,28 @@
+#include "utils.char.h"
+
+#define ST CC_STRING_TEXT
+#define ID (CC_IDENTIFIER | CC_STRING_TEXT)
+
+//	The ranges here don't overlap, so every byte gets all of its flags at once.
+uint8_t const FmlCharClasses[256] = {
+	['\t'] = CC_WHITESPACE, ['\n'] = CC_WHITESPACE, ['\r'] = CC_WHITESPACE,
+	[' '] = CC_WHITESPACE | ST,
+
+	['!'] = ST,
+	//	Double quotes aren't string text.
+	['#' ... ','] = ST,
+	['-'] = ID,
+	['.' ... '/'] = ST,
+	['0' ... '9'] = ID,
+	[':' ... '@'] = ST,
+	['A' ... 'Z'] = ID,
+	['['] = ST,
+	//	Neither are backslashes.
+	[']' ... '^'] = ST,
+	['_'] = ID,
+	['`'] = ST,
+	['a' ... 'z'] = ID,
+	['{' ... 127] = ST,
+
+	[192 ... 247] = CC_UTF8_FIRST,
+};
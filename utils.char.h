@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//	What each byte can be part of, as flags.
+enum CHAR_CLASSES
+{
+	CC_WHITESPACE	= 1 << 0,	//	Space, tab, newline and carriage return.
+	CC_IDENTIFIER	= 1 << 1,	//	ASCII letters, digits, underscores and hyphens.
+	CC_STRING_TEXT	= 1 << 2,	//	ASCII from space up, except `"` and `\`.
+	CC_UTF8_FIRST	= 1 << 3,	//	Starts a sequence of up to 4 bytes.
+};
+
+extern uint8_t const FmlCharClasses[256];
+
+static inline bool FmlCharIs(char c, unsigned classes)
+{
+	return (FmlCharClasses[(unsigned char)c] & classes) != 0;
+}
+
+//	What a character stands for after a backslash in a string. Anything
+//	without a meaning of its own stands for itself, like quotes and
+//	backslashes do.
+static inline char FmlUnescapeChar(char c)
+{
+	switch (c)
+	{
+	case 'a': return '\a';
+	case 'b': return '\b';
+	case 'f': return '\f';
+	case 'n': return '\n';
+	case 'r': return '\r';
+	case 't': return '\t';
+	case 'v': return '\v';
+	case '0': return '\0';
+	default: return c;
+	}
+}